@@ -0,0 +1,312 @@
+import os
+import resource
+import selectors
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from multiprocessing import Process, Queue
+
+
+# Packets as in rlib.h: cksum, len, ackno, seqno, then up to 500 bytes of data
+def cksum(data):
+    if len(data) % 2:
+        data += b'\0'
+    s = sum(struct.unpack('>%dH' % (len(data) // 2), data))
+    while s > 0xffff:
+        s = (s >> 16) + (s & 0xffff)
+    s = ~s & 0xffff
+    return s if s else 0xffff
+
+
+def data_packet(seqno, payload):
+    pkt = struct.pack('>HHII', 0, 12 + len(payload), 1, seqno) + payload
+    return struct.pack('>H', cksum(pkt)) + pkt[2:]
+
+
+def raise_nofile():
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+    return hard
+
+
+def sink(port):
+    """TCP server reading and discarding everything sent to it"""
+    raise_nofile()
+    sel = selectors.DefaultSelector()
+    ls = socket.socket()
+    ls.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    ls.bind(('127.0.0.1', port))
+    ls.listen(4096)
+    ls.setblocking(False)
+    sel.register(ls, selectors.EVENT_READ)
+    while True:
+        for key, _ in sel.select():
+            if key.fileobj is ls:
+                try:
+                    c, _ = ls.accept()
+                except OSError:
+                    continue
+                c.setblocking(False)
+                sel.register(c, selectors.EVENT_READ)
+            else:
+                try:
+                    d = key.fileobj.recv(65536)
+                except BlockingIOError:
+                    continue
+                except OSError:
+                    d = b''
+                if not d:
+                    sel.unregister(key.fileobj)
+                    key.fileobj.close()
+
+
+def drive_peers(udp_port, npeers, packets, results):
+    """Run npeers stop-and-wait senders of packets each; puts (elapsed seconds, RTTs in ms) on results"""
+    raise_nofile()
+    payload = b'x' * 500
+    sel = selectors.DefaultSelector()
+    peers = []
+    for i in range(npeers):
+        s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        s.bind(('127.0.0.1', 0))
+        s.connect(('127.0.0.1', udp_port))
+        s.setblocking(False)
+        # [socket, next seqno to send, send time of the outstanding packet]
+        peer = [s, 1, 0.0]
+        peers.append(peer)
+        sel.register(s, selectors.EVENT_READ, peer)
+
+    rtts = []
+    done = 0
+    start = time.time()
+    for peer in peers:
+        peer[2] = time.time()
+        peer[0].send(data_packet(peer[1], payload))
+
+    while done < npeers and time.time() - start < 60:
+        events = sel.select(0.2)
+        now = time.time()
+        for key, _ in events:
+            peer = key.data
+            while True:
+                try:
+                    pkt = peer[0].recv(1024)
+                except (BlockingIOError, ConnectionRefusedError):
+                    break
+                # plain ACKs only, extended ACKs (seqno 0, options) are ignored
+                if len(pkt) != 8 or peer[1] > packets:
+                    continue
+                ackno = struct.unpack('>I', pkt[4:8])[0]
+                if ackno <= peer[1]:
+                    continue
+                now = time.time()
+                rtts.append((now - peer[2]) * 1000)
+                peer[1] += 1
+                if peer[1] > packets:
+                    done += 1
+                    continue
+                peer[2] = now
+                peer[0].send(data_packet(peer[1], payload))
+        if not events:
+            # retransmit whatever has been waiting for a second
+            for peer in peers:
+                if peer[1] <= packets and now - peer[2] > 1:
+                    peer[0].send(data_packet(peer[1], payload))
+    results.put((time.time() - start, rtts))
+    for peer in peers:
+        peer[0].close()
+
+
+def run_peers(reliable, npeers, packets, server_args=(), clients=1, udp_port=41000, tcp_port=42000):
+    """Drive npeers peers, split over client processes, through one server; returns (packets/s, RTTs in ms)"""
+    sinkp = subprocess.Popen([sys.executable, __file__, 'sink', str(tcp_port)])
+    time.sleep(0.5)
+    server = subprocess.Popen([reliable, '-s', '-w', '4'] + list(server_args) + [str(udp_port), '127.0.0.1:%d' % tcp_port],
+                              stderr=subprocess.DEVNULL)
+    time.sleep(0.5)
+
+    results = Queue()
+    procs = [Process(target=drive_peers, args=(udp_port, npeers // clients + (i < npeers % clients), packets, results))
+             for i in range(clients)]
+    for p in procs:
+        p.start()
+    elapsed, rtts = 0, []
+    for p in procs:
+        e, r = results.get()
+        elapsed = max(elapsed, e)
+        rtts += r
+    for p in procs:
+        p.join()
+
+    server.kill()
+    sinkp.kill()
+    server.wait()
+    sinkp.wait()
+    return len(rtts) / elapsed, sorted(rtts)
+
+
+def report(label, rate, rtts):
+    if rtts:
+        print("%8s %12.0f %8.2fms %8.2fms" % (label, rate, rtts[len(rtts) // 2], rtts[len(rtts) * 99 // 100]))
+    else:
+        print("%8s %12s" % (label, 'no acks'))
+
+
+def peers(reliable, max_peers, packets):
+    limit = raise_nofile()
+    print("%8s %12s %10s %10s" % ('peers', 'packets/s', 'rtt p50', 'rtt p99'))
+    n = 1
+    while n <= max_peers:
+        if n + 16 > limit:
+            print("%8d skipped: RLIMIT_NOFILE is %d" % (n, limit))
+            break
+        rate, rtts = run_peers(reliable, n, packets)
+        report(n, rate, rtts)
+        n *= 10
+
+
+def threads(reliable, max_threads, npeers, packets):
+    """Scale server threads (pinned to CPUs) and client processes together from 1 to max_threads"""
+    raise_nofile()
+    print("%8s %12s %10s %10s" % ('threads', 'packets/s', 'rtt p50', 'rtt p99'))
+    n = 1
+    while n <= max_threads:
+        rate, rtts = run_peers(reliable, npeers, packets, ['-T', str(n), '-A', 'auto'], clients=n)
+        report(n, rate, rtts)
+        n *= 2
+
+
+def transfer(reliable, mss, size, window=32, ports=(43000, 43001), args=(), source=None):
+    """Send size bytes between two instances over loopback (both given args), written to the sender's stdin by
+    a thread, or read by it from the file source; returns (MB/s, packets sent by the sender, its input reads)"""
+    # stderr also gets a line per event, so it goes to a file rather than a pipe that could fill up
+    log = tempfile.TemporaryFile()
+    sender_cmd = [reliable, '-S', '-w', str(window), '--mss', str(mss), *args, str(ports[0]),
+                  'localhost:%d' % ports[1]]
+    receiver_cmd = [reliable, '-w', str(window), '--mss', str(mss), *args, str(ports[1]),
+                    'localhost:%d' % ports[0]]
+    if source is None:
+        sender = subprocess.Popen(sender_cmd, stdin=subprocess.PIPE, stdout=subprocess.DEVNULL, stderr=log)
+        time.sleep(0.2)
+        receiver = subprocess.Popen(receiver_cmd, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE,
+                                    stderr=subprocess.DEVNULL)
+        time.sleep(0.3)
+    else:
+        # a sender reading a file sends at once, so the receiver goes first, quiet until all data is in
+        receiver = subprocess.Popen(receiver_cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                    stderr=subprocess.DEVNULL)
+        time.sleep(0.2)
+
+    def feed():
+        block = os.urandom(1 << 20)
+        for i in range(0, size, len(block)):
+            sender.stdin.write(block[:size - i])
+        sender.stdin.close()
+
+    start = time.time()
+    if source is None:
+        feeder = threading.Thread(target=feed)
+        feeder.start()
+    else:
+        sender = subprocess.Popen(sender_cmd, stdin=source, stdout=subprocess.DEVNULL, stderr=log)
+    received = 0
+    while received < size:
+        data = receiver.stdout.read1(1 << 20)
+        if not data:
+            break
+        received += len(data)
+    elapsed = time.time() - start
+    if source is None:
+        feeder.join()
+    else:
+        receiver.stdin.close()
+
+    # the sender prints its stats when the connection closes
+    sender.wait(timeout=30)
+    log.seek(0)
+    stats = log.read().decode(errors='replace')
+    receiver.kill()
+    receiver.wait()
+    packets = reads = 0
+    for line in stats.splitlines():
+        if line.startswith('[stats] syscalls:'):
+            packets = int(line.split()[5])
+        elif line.startswith('[stats] input:'):
+            reads = int(line.split()[2])
+    return (received / elapsed / 1e6 if received == size else 0), packets, reads
+
+
+def mss(reliable, megabytes):
+    """Loopback throughput of a transfer at payload sizes from the default to a 64 KB datagram"""
+    size = megabytes * 1000000
+    print("%8s %12s %10s" % ('mss', 'MB/s', 'packets'))
+    for i, n in enumerate((500, 1400, 8192, 65495)):
+        # fresh ports, which no packet of the last run can reach
+        rate, packets, _ = transfer(reliable, n, size, ports=(43000 + 2 * i, 43001 + 2 * i))
+        print("%8d %12.1f %10d" % (n, rate, packets))
+
+
+def offload(reliable, megabytes):
+    """Loopback throughput of a transfer with UDP GSO/GRO and without, at a few payload sizes"""
+    size = megabytes * 1000000
+    print("%8s %12s %12s" % ('mss', 'MB/s off', 'MB/s on'))
+    for i, n in enumerate((500, 1400, 8192)):
+        rates = []
+        for j, mode in enumerate(('off', 'on')):
+            port = 43100 + 4 * i + 2 * j
+            rates.append(transfer(reliable, n, size, ports=(port, port + 1), args=('--offload', mode))[0])
+        print("%8d %12.1f %12.1f" % (n, rates[0], rates[1]))
+
+
+def readahead(reliable, megabytes):
+    """Loopback throughput of a transfer of a file on the sender's stdin, and the input reads it takes, at a
+    few window sizes: the sender reads as many packets as the window lets through with one readv"""
+    size = megabytes * 1000000
+    with tempfile.TemporaryFile() as f:
+        block = os.urandom(1 << 20)
+        for i in range(0, size, len(block)):
+            f.write(block[:size - i])
+        print("%8s %12s %10s %10s %14s" % ('window', 'MB/s', 'packets', 'reads', 'packets/read'))
+        for i, window in enumerate((1, 8, 32, 64)):
+            f.seek(0)
+            port = 43200 + 2 * i
+            rate, packets, reads = transfer(reliable, 500, size, window, ports=(port, port + 1), source=f)
+            print("%8d %12.1f %10d %10d %14.2f" % (window, rate, packets, reads, packets / max(reads, 1)))
+
+
+def main():
+    if len(sys.argv) >= 3 and sys.argv[1] == 'peers':
+        peers(sys.argv[2],
+              int(sys.argv[3]) if len(sys.argv) > 3 else 10000,
+              int(sys.argv[4]) if len(sys.argv) > 4 else 20)
+    elif len(sys.argv) >= 3 and sys.argv[1] == 'threads':
+        threads(sys.argv[2],
+                int(sys.argv[3]) if len(sys.argv) > 3 else os.cpu_count(),
+                int(sys.argv[4]) if len(sys.argv) > 4 else 1000,
+                int(sys.argv[5]) if len(sys.argv) > 5 else 20)
+    elif len(sys.argv) >= 3 and sys.argv[1] == 'mss':
+        mss(sys.argv[2],
+            int(sys.argv[3]) if len(sys.argv) > 3 else 100)
+    elif len(sys.argv) >= 3 and sys.argv[1] == 'offload':
+        offload(sys.argv[2],
+                int(sys.argv[3]) if len(sys.argv) > 3 else 100)
+    elif len(sys.argv) >= 3 and sys.argv[1] == 'readahead':
+        readahead(sys.argv[2],
+                  int(sys.argv[3]) if len(sys.argv) > 3 else 20)
+    elif len(sys.argv) == 3 and sys.argv[1] == 'sink':
+        sink(int(sys.argv[2]))
+    else:
+        print("usage: python3 %s peers <reliable> [max peers] [packets per peer]\n"
+              "       python3 %s threads <reliable> [max threads] [peers] [packets per peer]\n"
+              "       python3 %s mss <reliable> [megabytes]\n"
+              "       python3 %s offload <reliable> [megabytes]\n"
+              "       python3 %s readahead <reliable> [megabytes]" % ((sys.argv[0],) * 5))
+        exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,5 +1,39 @@
 #include "buffer.h"
 
+/**
+ * Allocate an empty buffer.
+ *
+ * @param   capacity    Number of slots, i.e. the window size (at least 1)
+ * @param   pool        Pool the inserted packets belong to
+ * @param   timers      Timer heap the node timers are armed in (NULL if none)
+ *
+ * @return  Pointer to the new buffer
+*/
+buffer_t* buffer_create(uint32_t capacity, pool_t *pool, timer_heap_t *timers) {
+    assert(capacity > 0 && pool->object_size >= REL_PKT_SIZE(REL_MSS_DEFAULT));
+    buffer_t* buffer = xmalloc(sizeof(buffer_t));
+    buffer->slots = xmalloc(capacity * sizeof(buffer_node_t));
+    memset(buffer->slots, 0, capacity * sizeof(buffer_node_t));
+    buffer->pool = pool;
+    buffer->timers = timers;
+    buffer->capacity = capacity;
+    buffer->size = 0;
+    buffer->first_seqno = 0;
+    buffer->last_seqno = 0;
+    return buffer;
+}
+
+/**
+ * Free the buffer and all its content.
+ *
+ * @param   buffer      Pointer to buffer
+*/
+void buffer_destroy(buffer_t *buffer) {
+    buffer_clear(buffer);
+    free(buffer->slots);
+    free(buffer);
+}
+
 /**
  * Get the first buffer node (lowest sequence number).
  *
@@ -8,7 +42,46 @@
  * @return  Pointer to first buffer node (NULL if none)
 */
 buffer_node_t* buffer_get_first(buffer_t *buffer) {
-    return buffer->head;
+    if (buffer->size == 0) {
+        return NULL;
+    }
+    return &buffer->slots[buffer->first_seqno % buffer->capacity];
+}
+
+/**
+ * Get the buffer node following the given one (next higher sequence number held).
+ *
+ * @param   buffer      Pointer to buffer
+ * @param   node        Pointer to a buffer node of this buffer
+ *
+ * @return  Pointer to next buffer node (NULL if none)
+*/
+buffer_node_t* buffer_next(buffer_t *buffer, buffer_node_t *node) {
+    uint32_t seqno = node->seqno;
+    while (seqno != buffer->last_seqno) {
+        seqno++;
+        buffer_node_t* next = &buffer->slots[seqno % buffer->capacity];
+        if (next->used) {
+            return next;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get the buffer node holding the packet with the given sequence number.
+ *
+ * @param   buffer      Pointer to buffer
+ * @param   seqno       Sequence number to look up
+ *
+ * @return  Pointer to buffer node (NULL if not held)
+*/
+buffer_node_t* buffer_get(buffer_t *buffer, uint32_t seqno) {
+    buffer_node_t* node = &buffer->slots[seqno % buffer->capacity];
+    if (node->used && node->seqno == seqno) {
+        return node;
+    }
+    return NULL;
 }
 
 /**
@@ -19,75 +92,71 @@ buffer_node_t* buffer_get_first(buffer_t *buffer) {
  * @return  0 iff first node removed, else non-zero
 */
 int buffer_remove_first(buffer_t *buffer) {
-    if (buffer->head == NULL) {
+    buffer_node_t* to_remove = buffer_get_first(buffer);
+    if (to_remove == NULL) {
         return 1;
-    } else {
-        buffer_node_t* to_remove = buffer->head;
-        buffer->head = buffer->head->next;
-        free(to_remove);
-        return 0;
     }
+
+    // Advance to the next held sequence number (the window holds no gaps wider than its capacity)
+    buffer_node_t* next = buffer_next(buffer, to_remove);
+    if (buffer->timers != NULL) {
+        timer_cancel(buffer->timers, &to_remove->timer);
+    }
+    pool_put(buffer->pool, to_remove->packet);
+    to_remove->packet = NULL;
+    to_remove->used = 0;
+    buffer->size--;
+    if (next != NULL) {
+        buffer->first_seqno = next->seqno;
+    }
+    return 0;
 }
 
 /**
- * Inserting a packet in its place by its sequence number.
+ * Inserting a packet in its place by its sequence number, without copying it.
+ * On success the buffer takes ownership of the packet (replacing a packet with the same sequence number),
+ * on failure the caller keeps it.
  *
  * @param   buffer              Pointer to buffer
- * @param   packet              Pointer to packet
+ * @param   packet              Pointer to packet (an object of the buffer's pool)
  * @param   last_retransmit     Last retransmission time (long)
+ *
+ * @return  0 iff inserted, else non-zero (sequence number does not fit in the window)
 */
-void buffer_insert(buffer_t *buffer, packet_t *packet, long last_retransmit) {
-
-    // Node to insert
-    buffer_node_t* to_insert = xmalloc(sizeof(buffer_node_t));
-    to_insert->packet = *packet;
-    to_insert->last_retransmit = last_retransmit;
-
-    // When iterating, previous and current
-    buffer_node_t* prev = NULL;
-    buffer_node_t* current = buffer_get_first(buffer);
+int buffer_insert(buffer_t *buffer, packet_t *packet, long last_retransmit) {
+    uint32_t seqno = ntohl(packet->seqno);
+
+    // The held sequence numbers (incl. the new one) must span at most capacity slots
+    if (buffer->size > 0) {
+        uint32_t first = seqno < buffer->first_seqno ? seqno : buffer->first_seqno;
+        uint32_t last = seqno > buffer->last_seqno ? seqno : buffer->last_seqno;
+        if (last - first >= buffer->capacity) {
+            return 1;
+        }
+    }
 
-    // If the buffer is empty, add as head
-    if (current == NULL) {
-        buffer->head = to_insert;
-        to_insert->next = NULL;
+    buffer_node_t* to_insert = &buffer->slots[seqno % buffer->capacity];
+    if (to_insert->used) {
+        if (to_insert->packet != packet) {
+            pool_put(buffer->pool, to_insert->packet);
+        }
     } else {
-
-        // If the buffer is not empty, go until a packet with a higher sequence
-        // number is found
-        while (current != NULL) {
-
-            // If found an element whose sequence number is higher
-            if (ntohl(current->packet.seqno) > ntohl(packet->seqno)) {
-
-                // If it was the head (there is no previous)
-                if (prev == NULL) {
-                    buffer->head = to_insert;
-                    to_insert->next = current;
-
-                // If it was somewhere in between
-                } else {
-                    prev->next = to_insert;
-                    to_insert->next = current;
-                }
-
-                break;
-
-            // If at the tail, then add there, and finish
-            } else if (current->next == NULL) {
-                current->next = to_insert;
-                to_insert->next = NULL;
-                break;
-            }
-
-            // Move on
-            prev = current;
-            current = current->next;
-
+        if (buffer->size == 0 || seqno < buffer->first_seqno) {
+            buffer->first_seqno = seqno;
         }
-
+        if (buffer->size == 0 || seqno > buffer->last_seqno) {
+            buffer->last_seqno = seqno;
+        }
+        buffer->size++;
     }
 
+    to_insert->packet = packet;
+    to_insert->last_retransmit = last_retransmit;
+    to_insert->retransmits = 0;
+    to_insert->sacked = 0;
+    to_insert->seqno = seqno;
+    to_insert->used = 1;
+    return 0;
 }
 
 /**
@@ -99,16 +168,10 @@ void buffer_insert(buffer_t *buffer, packet_t *packet, long last_retransmit) {
  * @return  Number of buffer nodes removed
 */
 uint32_t buffer_remove(buffer_t *buffer, uint32_t seqno_until_excl) {
-    buffer_node_t* first = buffer_get_first(buffer);
     uint32_t num_removed = 0;
-    while (first != NULL) {
-        if (ntohl(first->packet.seqno) >= seqno_until_excl) {
-            break;
-        } else {
-            buffer_remove_first(buffer);
-            first = buffer_get_first(buffer);
-            num_removed++;
-        }
+    while (buffer->size > 0 && buffer->first_seqno < seqno_until_excl) {
+        buffer_remove_first(buffer);
+        num_removed++;
     }
     return num_removed;
 }
@@ -127,8 +190,8 @@ void buffer_print(buffer_t *buffer) {
         } else {
             first = 0;
         }
-        fprintf(stderr, "%d (l=%d)" , ntohl(current->packet.seqno), ntohs(current->packet.len));
-        current = current->next;
+        fprintf(stderr, "%d (l=%d)" , ntohl(current->packet->seqno), ntohs(current->packet->len));
+        current = buffer_next(buffer, current);
     }
     fprintf(stderr, "\n");
 }
@@ -141,13 +204,7 @@ void buffer_print(buffer_t *buffer) {
  * @return  Buffer size
 */
 uint32_t buffer_size(buffer_t *buffer) {
-    uint32_t i = 0;
-    buffer_node_t* current = buffer_get_first(buffer);
-    while (current != NULL) {
-        i++;
-        current = current->next;
-    }
-    return i;
+    return buffer->size;
 }
 
 /**
@@ -170,14 +227,5 @@ void buffer_clear(buffer_t *buffer) {
  * @return  1 iff the buffer contains the packet, 0 otherwise
 */
 int buffer_contains(buffer_t *buffer, uint32_t seqno) {
-    int in_there = 0;
-    buffer_node_t* current = buffer_get_first(buffer);
-    while (current != NULL) {
-        if (ntohl(current->packet.seqno) == seqno) {
-            in_there = 1;
-            break;
-        }
-        current = current->next;
-    }
-    return in_there;
+    return buffer_get(buffer, seqno) != NULL;
 }
@@ -16,30 +16,65 @@
 #include <netinet/in.h>
 
 #include "rlib.h"
+#include "pool.h"
+#include "timer.h"
 
 /*
- * A buffer is a priority queue of buffer nodes.
- * It is ordered by the packet sequence number (seqno).
+ * A buffer is a fixed-capacity window of buffer nodes, indexed by the packet sequence number (seqno).
  *
- * Each buffer node has three properties: (a) a full copy of the packet (incl. its sequence number),
- * (b) the last time it was transmitted, and (c) the next packet in the list (NULL if none).
+ * The nodes live in a circular array of `capacity` slots, and the packet with sequence number s is stored
+ * in slot (s % capacity). All packets held at the same time must therefore lie within a span of `capacity`
+ * consecutive sequence numbers, which is exactly what a sliding window of that size guarantees. This gives
+ * O(1) insertion, lookup and removal of the first node, and the number of held nodes is kept as a counter.
  *
- * The content of the buffer (its nodes) are allocated on the heap, including the full packet copies.
- * After serving its purpose, its content must be freed explicitly (via buffer_clear(buffer)) for proper clean-up.
- * Free-ing merely the buffer pointer DOES NOT suffice (but it should be done of course after clearing the buffer
- * content).
+ * Each buffer node has six properties: (a) the packet (incl. its sequence number), (b) the last time it was
+ * transmitted, (c) how often it was retransmitted, (d) whether the receiver reported holding it (SACK),
+ * (e) its retransmission timer, and (f) whether the slot is in use.
+ *
+ * The slots of the buffer are allocated on the heap once by buffer_create(capacity, pool, timers). The
+ * packets are not copied: buffer_insert() takes over a packet drawn from the given (connection's) packet
+ * pool, and the node owns it until removal returns it to the pool (after cancelling the node's timer).
+ * After serving its purpose, the buffer must be freed explicitly (via buffer_destroy(buffer)).
 */
 
 typedef struct buffer_node {
-    packet_t packet;
+    packet_t* packet;
     long last_retransmit;
-    struct buffer_node* next;
+    uint32_t retransmits;   /* Number of retransmissions (0 for a fresh packet) */
+    int sacked;             /* Selectively acknowledged by the receiver (needs no retransmission) */
+    timer_entry_t timer;    /* Retransmission timer (armed by the owner) */
+    uint32_t seqno;     /* Sequence number in host order (valid iff used) */
+    int used;
 } buffer_node_t;
 
 typedef struct buffer {
-    buffer_node_t* head;
+    buffer_node_t* slots;
+    pool_t* pool;           /* Pool the held packets are returned to */
+    timer_heap_t* timers;   /* Heap the node timers are armed in (NULL if none) */
+    uint32_t capacity;
+    uint32_t size;          /* Number of used slots */
+    uint32_t first_seqno;   /* Lowest sequence number held (valid iff size > 0) */
+    uint32_t last_seqno;    /* Highest sequence number held (valid iff size > 0) */
 } buffer_t;
 
+/**
+ * Allocate an empty buffer.
+ *
+ * @param   capacity    Number of slots, i.e. the window size (at least 1)
+ * @param   pool        Pool the inserted packets belong to
+ * @param   timers      Timer heap the node timers are armed in (NULL if none)
+ *
+ * @return  Pointer to the new buffer
+*/
+buffer_t* buffer_create(uint32_t capacity, pool_t *pool, timer_heap_t *timers);
+
+/**
+ * Free the buffer and all its content.
+ *
+ * @param   buffer      Pointer to buffer
+*/
+void buffer_destroy(buffer_t *buffer);
+
 /**
  * Get the first buffer node (lowest sequence number).
  *
@@ -49,6 +84,26 @@ typedef struct buffer {
 */
 buffer_node_t* buffer_get_first(buffer_t *buffer);
 
+/**
+ * Get the buffer node following the given one (next higher sequence number held).
+ *
+ * @param   buffer      Pointer to buffer
+ * @param   node        Pointer to a buffer node of this buffer
+ *
+ * @return  Pointer to next buffer node (NULL if none)
+*/
+buffer_node_t* buffer_next(buffer_t *buffer, buffer_node_t *node);
+
+/**
+ * Get the buffer node holding the packet with the given sequence number.
+ *
+ * @param   buffer      Pointer to buffer
+ * @param   seqno       Sequence number to look up
+ *
+ * @return  Pointer to buffer node (NULL if not held)
+*/
+buffer_node_t* buffer_get(buffer_t *buffer, uint32_t seqno);
+
 /**
  * Remove the first buffer node (lowest sequence number).
  *
@@ -59,14 +114,17 @@ buffer_node_t* buffer_get_first(buffer_t *buffer);
 int buffer_remove_first(buffer_t *buffer);
 
 /**
- * Inserting a packet in its place by its sequence number.
- * The packet itself is completely copied onto the heap.
+ * Inserting a packet in its place by its sequence number, without copying it.
+ * On success the buffer takes ownership of the packet (replacing a packet with the same sequence number),
+ * on failure the caller keeps it.
  *
  * @param   buffer              Pointer to buffer
- * @param   packet              Pointer to packet
+ * @param   packet              Pointer to packet (an object of the buffer's pool)
  * @param   last_retransmit     Last retransmission time (long)
+ *
+ * @return  0 iff inserted, else non-zero (sequence number does not fit in the window)
 */
-void buffer_insert(buffer_t *buffer, packet_t *packet, long last_retransmit);
+int buffer_insert(buffer_t *buffer, packet_t *packet, long last_retransmit);
 
 /**
  * Remove all buffer nodes until (lower-than exclusive <) a certain packet sequence number from the buffer.
@@ -0,0 +1,247 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "cksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif /* __x86_64__ || __i386__ */
+
+/**
+ * The reference: sum big-endian 16-bit words, two bytes at a time.
+ *
+ * @param   data        Pointer to packet over which cksum is computed
+ * @param   len         Length of the packet
+ *
+ * @return  checksum (network byte order)
+*/
+static uint16_t cksum_scalar(const void *_data, int len) {
+    const uint8_t *data = _data;
+    uint32_t sum;
+
+    for (sum = 0; len >= 2; data += 2, len -= 2)
+        sum += data[0] << 8 | data[1];
+    if (len > 0)
+        sum += data[0] << 8;
+    while (sum > 0xffff)
+        sum = (sum >> 16) + (sum & 0xffff);
+    sum = htons(~sum);
+    return sum ? sum : 0xffff;
+}
+
+/**
+ * Fold a sum of native words down to 16 bits with end-around carries.
+ *
+ * @param   sum         Sum of native 16- or 32-bit words
+ *
+ * @return  One's complement sum (0 only if sum is 0)
+*/
+static uint16_t fold(uint64_t sum) {
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+/**
+ * Fold a sum of native words and complement it. Since the sum was taken in native byte order, the result
+ * is already in network byte order.
+ *
+ * @param   sum         Sum of native 16- or 32-bit words
+ *
+ * @return  checksum (network byte order)
+*/
+static uint16_t finish(uint64_t sum) {
+    uint16_t r = ~fold(sum);
+    return r ? r : 0xffff;
+}
+
+/**
+ * Add the data as native 32-bit words to a 64-bit sum, which cannot overflow before 2^32 words.
+ *
+ * @param   p           Pointer to data (no alignment required)
+ * @param   len         Length of the data
+ * @param   sum         Sum so far
+ *
+ * @return  New sum (not folded)
+*/
+static uint64_t sum_wide(const unsigned char *p, int len, uint64_t sum) {
+    uint64_t w0, w1, w2, w3;
+
+    while (len >= 32) {
+        memcpy(&w0, p, 8);
+        memcpy(&w1, p + 8, 8);
+        memcpy(&w2, p + 16, 8);
+        memcpy(&w3, p + 24, 8);
+        sum += (uint32_t)w0 + (w0 >> 32) + (uint32_t)w1 + (w1 >> 32);
+        sum += (uint32_t)w2 + (w2 >> 32) + (uint32_t)w3 + (w3 >> 32);
+        p += 32;
+        len -= 32;
+    }
+    while (len >= 8) {
+        memcpy(&w0, p, 8);
+        sum += (uint32_t)w0 + (w0 >> 32);
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        sum += w;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t w;
+        memcpy(&w, p, 2);
+        sum += w;
+        p += 2;
+        len -= 2;
+    }
+    if (len > 0) {
+        // the odd byte is the first of a word padded with zero
+        uint8_t b[2] = {p[0], 0};
+        uint16_t w;
+        memcpy(&w, b, 2);
+        sum += w;
+    }
+    return sum;
+}
+
+static uint16_t cksum_wide(const void *data, int len) {
+    return finish(sum_wide(data, len, 0));
+}
+
+#if HAVE_X86
+// Both vector versions widen each 32-bit word to a 64-bit lane (interleaving with zero) and add the lanes
+
+__attribute__((target("sse2")))
+static uint16_t cksum_sse2(const void *data, int len) {
+    const unsigned char *p = data;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+    uint64_t lanes[2];
+
+    while (len >= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i*)p);
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+        p += 32;
+        len -= 32;
+    }
+    _mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(acc0, acc1));
+    return finish(sum_wide(p, len, lanes[0] + lanes[1]));
+}
+
+__attribute__((target("avx2")))
+static uint16_t cksum_avx2(const void *data, int len) {
+    const unsigned char *p = data;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero;
+    uint64_t lanes[4];
+
+    while (len >= 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)p);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+        p += 64;
+        len -= 64;
+    }
+    _mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(acc0, acc1));
+    return finish(sum_wide(p, len, lanes[0] + lanes[1] + lanes[2] + lanes[3]));
+}
+
+static int have_sse2(void) {
+    return __builtin_cpu_supports("sse2");
+}
+
+static int have_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+#endif /* HAVE_X86 */
+
+static int have_any(void) {
+    return 1;
+}
+
+// Slowest first: cksum() uses the last one the CPU supports
+static const cksum_impl_t cksum_implementations[] = {
+    {"scalar", cksum_scalar, have_any},
+    {"wide", cksum_wide, have_any},
+#if HAVE_X86
+    {"sse2", cksum_sse2, have_sse2},
+    {"avx2", cksum_avx2, have_avx2},
+#endif /* HAVE_X86 */
+};
+
+#define CKSUM_IMPLEMENTATIONS (sizeof(cksum_implementations) / sizeof(cksum_implementations[0]))
+
+static cksum_fn cksum_best = cksum_wide;
+
+// Chosen before main() so that threads never race on it
+__attribute__((constructor))
+static void cksum_init(void) {
+#if HAVE_X86
+    __builtin_cpu_init();
+#endif /* HAVE_X86 */
+    for (size_t i = 0; i < CKSUM_IMPLEMENTATIONS; i++) {
+        if (cksum_implementations[i].supported()) {
+            cksum_best = cksum_implementations[i].fn;
+        }
+    }
+}
+
+/**
+ * Compute the checksum of a packet with the fastest implementation.
+ *
+ * @param   data        Pointer to packet over which cksum is computed
+ * @param   len         Length of the packet
+ *
+ * @return  checksum (network byte order)
+*/
+uint16_t cksum(const void *data, int len) {
+    return cksum_best(data, len);
+}
+
+/**
+ * Update the checksum of a packet after a field changed (RFC 1624, equation 3: HC' = ~(~HC + ~m + m')),
+ * in time proportional to the field rather than the packet. The result is the one cksum() would compute.
+ *
+ * @param   sum         The packet's checksum, as stored in the packet
+ * @param   old         Pointer to the field's old contents
+ * @param   new         Pointer to the field's new contents
+ * @param   len         Length of the field (even, and at an even offset in the packet)
+ *
+ * @return  New checksum (network byte order)
+*/
+uint16_t cksum_update(uint16_t sum, const void *old, const void *new, int len) {
+    // cksum() sends a checksum of 0 as 0xffff: either way the sum was 0xffff (negative zero)
+    uint64_t s = sum == 0xffff ? 0xffff : (uint16_t)~sum;
+    s += (uint16_t)~fold(sum_wide(old, len, 0));
+    s += sum_wide(new, len, 0);
+    return finish(s);
+}
+
+/**
+ * Look up a checksum implementation by name.
+ *
+ * @param   name        Name of the implementation ("scalar", "wide", "sse2" or "avx2")
+ *
+ * @return  Pointer to the implementation (NULL if unknown or not supported by this CPU)
+*/
+const cksum_impl_t* cksum_lookup(const char *name) {
+    for (size_t i = 0; i < CKSUM_IMPLEMENTATIONS; i++) {
+        if (strcmp(cksum_implementations[i].name, name) == 0) {
+            return cksum_implementations[i].supported() ? &cksum_implementations[i] : NULL;
+        }
+    }
+    return NULL;
+}
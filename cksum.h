@@ -0,0 +1,59 @@
+#ifndef CKSUM_H
+#define CKSUM_H
+
+#include <stdint.h>
+
+/*
+ * The Internet checksum (RFC 1071) of rlib packets: the one's complement of the one's complement sum of the
+ * data as big-endian 16-bit words, returned in network byte order, with 0 sent as 0xffff.
+ *
+ * The one's complement sum does not depend on the byte order it is computed in (RFC 1071, section 2), so
+ * the fast implementations sum native words, 32 bits at a time into 64-bit accumulators, and fold the
+ * carries back in only once at the end. cksum() uses the widest one the CPU supports, chosen at startup;
+ * all of them return bit-identical results.
+ *
+ * Implementations: "scalar" (the reference, two bytes at a time), "wide" (64-bit accumulation), "sse2" and
+ * "avx2" (x86 only).
+*/
+
+typedef uint16_t (*cksum_fn)(const void *data, int len);
+
+typedef struct cksum_impl {
+    const char* name;
+    cksum_fn fn;
+    int (*supported)(void);     /* Non-zero if the CPU can run fn */
+} cksum_impl_t;
+
+/**
+ * Compute the checksum of a packet with the fastest implementation.
+ *
+ * @param   data        Pointer to packet over which cksum is computed
+ * @param   len         Length of the packet
+ *
+ * @return  checksum (network byte order)
+*/
+uint16_t cksum(const void *data, int len);
+
+/**
+ * Update the checksum of a packet after a field changed (RFC 1624, equation 3: HC' = ~(~HC + ~m + m')),
+ * in time proportional to the field rather than the packet. The result is the one cksum() would compute.
+ *
+ * @param   sum         The packet's checksum, as stored in the packet
+ * @param   old         Pointer to the field's old contents
+ * @param   new         Pointer to the field's new contents
+ * @param   len         Length of the field (even, and at an even offset in the packet)
+ *
+ * @return  New checksum (network byte order)
+*/
+uint16_t cksum_update(uint16_t sum, const void *old, const void *new, int len);
+
+/**
+ * Look up a checksum implementation by name.
+ *
+ * @param   name        Name of the implementation ("scalar", "wide", "sse2" or "avx2")
+ *
+ * @return  Pointer to the implementation (NULL if unknown or not supported by this CPU)
+*/
+const cksum_impl_t* cksum_lookup(const char *name);
+
+#endif /* CKSUM_H */
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cksum.h"
+
+/*
+ * Checks every checksum implementation the CPU supports against the scalar reference over random data,
+ * lengths and alignments, and incremental updates against full checksums, or with "bench", measures each
+ * implementation's throughput.
+ *
+ * usage: cksum_test [bench]
+*/
+
+#define MAX_LEN 4096
+#define MAX_ALIGN 64
+#define ITERATIONS 200000
+
+static const char *names[] = {"wide", "sse2", "avx2"};
+#define NAMES (sizeof(names) / sizeof(names[0]))
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fill a buffer with random bytes, sometimes all 0x00 or 0xff to hit the folding corner cases.
+ *
+ * @param   buf         Pointer to buffer
+ * @param   len         Length of the buffer
+*/
+static void fill(unsigned char *buf, int len) {
+    int kind = rand() % 8;
+    for (int i = 0; i < len; i++) {
+        buf[i] = kind == 0 ? 0x00 : kind == 1 ? 0xff : rand();
+    }
+}
+
+static int test(void) {
+    static unsigned char buf[MAX_LEN + MAX_ALIGN];
+    const cksum_impl_t *scalar = cksum_lookup("scalar");
+    int failures = 0;
+
+    for (size_t n = 0; n < NAMES; n++) {
+        const cksum_impl_t *impl = cksum_lookup(names[n]);
+        if (!impl) {
+            printf("%-6s not supported, skipped\n", names[n]);
+            continue;
+        }
+        srand(1);
+        int i;
+        for (i = 0; i < ITERATIONS; i++) {
+            int len = i < MAX_LEN ? i : rand() % (MAX_LEN + 1);
+            int align = rand() % MAX_ALIGN;
+            fill(buf + align, len);
+            uint16_t expected = scalar->fn(buf + align, len);
+            uint16_t got = impl->fn(buf + align, len);
+            if (got != expected) {
+                printf("%-6s FAILED: len %d, alignment %d: 0x%04x, expected 0x%04x\n",
+                       names[n], len, align, got, expected);
+                failures++;
+                break;
+            }
+        }
+        if (i == ITERATIONS) {
+            printf("%-6s ok (%d random buffers)\n", names[n], ITERATIONS);
+        }
+    }
+
+    // cksum() itself, on packets of the protocol's sizes
+    for (int len = 0; len <= 512; len++) {
+        fill(buf, len);
+        if (cksum(buf, len) != scalar->fn(buf, len)) {
+            printf("cksum  FAILED: len %d\n", len);
+            return 1;
+        }
+    }
+    printf("cksum  ok\n");
+
+    // cksum_update() after changing a random field of a random packet must agree with cksum()
+    for (int i = 0; i < ITERATIONS; i++) {
+        int len = 2 + rand() % 511;
+        int off = 2 * (rand() % (len / 2));
+        int field = 2 * (1 + rand() % ((len - off) / 2));
+        unsigned char old[MAX_LEN];
+        fill(buf, len);
+        uint16_t sum = cksum(buf, len);
+        memcpy(old, buf + off, field);
+        fill(buf + off, field);
+        uint16_t got = cksum_update(sum, old, buf + off, field);
+        if (got != cksum(buf, len)) {
+            printf("update FAILED: len %d, field %d at %d: 0x%04x, expected 0x%04x\n",
+                   len, field, off, got, cksum(buf, len));
+            return 1;
+        }
+    }
+    printf("update ok (%d random fields)\n", ITERATIONS);
+    return failures != 0;
+}
+
+static void bench(void) {
+    static const int sizes[] = {8, 64, 512, 1500, 65536};
+    static const char *all[] = {"scalar", "wide", "sse2", "avx2"};
+    static unsigned char buf[65536];
+    volatile uint16_t sink = 0;
+
+    fill(buf, sizeof(buf));
+    printf("%-8s", "bytes");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        printf("%10d", sizes[s]);
+    }
+    printf("   (GB/s)\n");
+    for (size_t n = 0; n < sizeof(all) / sizeof(all[0]); n++) {
+        const cksum_impl_t *impl = cksum_lookup(all[n]);
+        if (!impl) {
+            continue;
+        }
+        printf("%-8s", all[n]);
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            long calls = 0, batch = (1 << 24) / sizes[s] + 1;
+            double start = now(), elapsed;
+            do {
+                for (long i = 0; i < batch; i++) {
+                    sink += impl->fn(buf, sizes[s]);
+                }
+                calls += batch;
+            } while ((elapsed = now() - start) < 0.2);
+            printf("%10.2f", (double)calls * sizes[s] / elapsed / 1e9);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench();
+        return 0;
+    }
+    return test();
+}
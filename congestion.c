@@ -0,0 +1,231 @@
+#include <math.h>
+#include <string.h>
+
+#include "congestion.h"
+
+// CUBIC constants (RFC 8312, section 5)
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+/**
+ * Shrink the window after a loss to half of what was in flight (RFC 5681, equation 4).
+*/
+static double half_flight(uint32_t flight) {
+    return flight / 2.0 > 2.0 ? flight / 2.0 : 2.0;
+}
+
+/*
+ * none: the fixed window of the sender
+*/
+
+static void none_init(congestion_t *cc) {
+    cc->cwnd = cc->max_cwnd;
+    cc->ssthresh = cc->max_cwnd;
+}
+
+static void none_on_ack(congestion_t *cc, uint32_t acked, long now, long srtt) {
+}
+
+static void none_on_loss(congestion_t *cc, uint32_t flight, long now) {
+}
+
+/*
+ * reno: slow start and additive increase by one packet per round trip, multiplicative decrease on loss
+*/
+
+static void reno_init(congestion_t *cc) {
+    cc->cwnd = 1;
+    cc->ssthresh = cc->max_cwnd;
+}
+
+static void reno_on_ack(congestion_t *cc, uint32_t acked, long now, long srtt) {
+    if (cc->cwnd < cc->ssthresh) {
+        cc->cwnd += acked;
+    } else {
+        cc->cwnd += (double)acked / cc->cwnd;
+    }
+}
+
+static void reno_on_loss(congestion_t *cc, uint32_t flight, long now) {
+    cc->ssthresh = half_flight(flight);
+    cc->cwnd = cc->ssthresh;
+}
+
+static void reno_on_timeout(congestion_t *cc, uint32_t flight, long now) {
+    cc->ssthresh = half_flight(flight);
+    cc->cwnd = 1;
+}
+
+/*
+ * cubic: the window follows a cubic function of the time since the last loss, centered on the window at
+ * which that loss happened, but never grows slower than Reno would
+*/
+
+static void cubic_init(congestion_t *cc) {
+    reno_init(cc);
+    cc->w_max = 0;
+    cc->k = 0;
+    cc->epoch_start = 0;
+}
+
+static void cubic_on_ack(congestion_t *cc, uint32_t acked, long now, long srtt) {
+    if (cc->cwnd < cc->ssthresh) {
+        cc->cwnd += acked;
+        return;
+    }
+
+    if (cc->epoch_start == 0) {
+        // first congestion avoidance after slow start: grow from the current window
+        cc->epoch_start = now;
+        if (cc->w_max < cc->cwnd) {
+            cc->w_max = cc->cwnd;
+        }
+        cc->k = cbrt(cc->w_max * (1 - CUBIC_BETA) / CUBIC_C);
+    }
+
+    // target window one round trip ahead (equation 1), or the TCP-friendly window (equation 4) if larger
+    double t = (now - cc->epoch_start + srtt) / 1000.0;
+    double target = CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k) + cc->w_max;
+    double rtt = srtt > 0 ? srtt / 1000.0 : 0.001;
+    double w_est = cc->w_max * CUBIC_BETA + 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * (t / rtt);
+    if (target < w_est) {
+        target = w_est;
+    }
+
+    if (target > cc->cwnd) {
+        cc->cwnd += (target - cc->cwnd) * acked / cc->cwnd;
+    } else {
+        cc->cwnd += 0.01 * acked / cc->cwnd;
+    }
+}
+
+static void cubic_on_loss(congestion_t *cc, uint32_t flight, long now) {
+    // fast convergence: release bandwidth when the window did not get back to where it was
+    if (cc->cwnd < cc->w_max) {
+        cc->w_max = cc->cwnd * (1 + CUBIC_BETA) / 2;
+    } else {
+        cc->w_max = cc->cwnd;
+    }
+    cc->cwnd = cc->cwnd * CUBIC_BETA > 2 ? cc->cwnd * CUBIC_BETA : 2;
+    cc->ssthresh = cc->cwnd;
+    cc->k = cbrt(cc->w_max * (1 - CUBIC_BETA) / CUBIC_C);
+    cc->epoch_start = now;
+}
+
+static void cubic_on_timeout(congestion_t *cc, uint32_t flight, long now) {
+    cubic_on_loss(cc, flight, now);
+    cc->cwnd = 1;
+    cc->epoch_start = 0;
+}
+
+static const congestion_ops_t congestion_algorithms[] = {
+    {"none", none_init, none_on_ack, none_on_loss, none_on_loss},
+    {"reno", reno_init, reno_on_ack, reno_on_loss, reno_on_timeout},
+    {"newreno", reno_init, reno_on_ack, reno_on_loss, reno_on_timeout},
+    {"cubic", cubic_init, cubic_on_ack, cubic_on_loss, cubic_on_timeout},
+};
+
+/**
+ * Look up a congestion control algorithm by name.
+ *
+ * @param   name        Name of the algorithm ("none", "reno" (or "newreno") or "cubic")
+ *
+ * @return  Pointer to the algorithm's hooks (NULL if unknown)
+*/
+const congestion_ops_t* congestion_lookup(const char *name) {
+    for (size_t i = 0; i < sizeof(congestion_algorithms) / sizeof(congestion_algorithms[0]); i++) {
+        if (strcmp(congestion_algorithms[i].name, name) == 0) {
+            return &congestion_algorithms[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Initialize the congestion control state of a connection.
+ *
+ * @param   cc          Pointer to congestion control state
+ * @param   ops         Pointer to the algorithm's hooks
+ * @param   max_cwnd    The sender's fixed window in packets
+*/
+void congestion_init(congestion_t *cc, const congestion_ops_t *ops, uint32_t max_cwnd) {
+    memset(cc, 0, sizeof(congestion_t));
+    cc->ops = ops;
+    cc->max_cwnd = max_cwnd;
+    ops->init(cc);
+}
+
+/**
+ * Account for an ACK that acknowledged new packets.
+ *
+ * @param   cc          Pointer to congestion control state
+ * @param   ackno       Cumulative acknowledgement number of the ACK
+ * @param   acked       Number of packets newly acknowledged
+ * @param   now         Current time in milliseconds
+ * @param   srtt        Smoothed round-trip time in milliseconds
+ *
+ * @return  1 if it is a partial ACK in recovery (the packet at ackno is lost too and should be resent),
+ *          0 otherwise
+*/
+int congestion_on_ack(congestion_t *cc, uint32_t ackno, uint32_t acked, long now, long srtt) {
+    // a partial ACK keeps the window as is (and the recovery going), a full ACK ends the recovery
+    if (cc->in_recovery) {
+        if (ackno <= cc->recover) {
+            return 1;
+        }
+        cc->in_recovery = 0;
+    }
+
+    cc->ops->on_ack(cc, acked, now, srtt);
+    if (cc->cwnd > cc->max_cwnd) {
+        cc->cwnd = cc->max_cwnd;
+    }
+    return 0;
+}
+
+/**
+ * Account for a loss detected by duplicate ACKs (no-op during recovery, or for packets sent before the last
+ * reduction of the window).
+ *
+ * @param   cc          Pointer to congestion control state
+ * @param   ackno       Cumulative acknowledgement number of the duplicate ACKs
+ * @param   flight      Number of packets in flight
+ * @param   highest     Highest sequence number sent so far
+ * @param   now         Current time in milliseconds
+*/
+void congestion_on_loss(congestion_t *cc, uint32_t ackno, uint32_t flight, uint32_t highest, long now) {
+    if (cc->in_recovery || ackno <= cc->recover) {
+        return;
+    }
+    cc->in_recovery = 1;
+    cc->recover = highest;
+    cc->losses++;
+    cc->ops->on_loss(cc, flight, now);
+}
+
+/**
+ * Account for a retransmission timeout.
+ *
+ * @param   cc          Pointer to congestion control state
+ * @param   flight      Number of packets in flight
+ * @param   highest     Highest sequence number sent so far
+ * @param   now         Current time in milliseconds
+*/
+void congestion_on_timeout(congestion_t *cc, uint32_t flight, uint32_t highest, long now) {
+    // back to slow start; duplicate ACKs for what was in flight must not reduce the window again
+    cc->in_recovery = 0;
+    cc->recover = highest;
+    cc->timeouts++;
+    cc->ops->on_timeout(cc, flight, now);
+}
+
+/**
+ * Get the congestion window.
+ *
+ * @param   cc          Pointer to congestion control state
+ *
+ * @return  Number of packets that may be in flight (at least 1)
+*/
+uint32_t congestion_window(congestion_t *cc) {
+    return cc->cwnd >= 1 ? (uint32_t)cc->cwnd : 1;
+}
@@ -0,0 +1,111 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <stdint.h>
+
+/*
+ * Congestion control limits the number of packets in flight to a congestion window (cwnd, in packets) that
+ * grows while ACKs arrive and shrinks when packets are lost. The sender's effective window is the minimum of
+ * the congestion window and its fixed window size.
+ *
+ * Each algorithm is a table of hooks (congestion_ops_t) operating on a congestion_t, which holds the state
+ * common to all of them (cwnd, ssthresh, loss recovery) plus the algorithm's own. Recovery is handled here,
+ * as in NewReno (RFC 6582): a loss reduces the window once, and the window does not grow again until the
+ * packets that were in flight at the time of the loss have all been acknowledged. An ACK that covers only
+ * some of them (a partial ACK) shows that the packet it asks for next was lost as well, which the sender
+ * then resends right away, staying in recovery.
+ *
+ * Algorithms: "none" (the fixed window), "reno" or "newreno" (NewReno, RFC 5681/6582) and "cubic"
+ * (RFC 8312).
+*/
+
+struct congestion;
+
+typedef struct congestion_ops {
+    const char* name;
+    void (*init)(struct congestion *cc);
+    void (*on_ack)(struct congestion *cc, uint32_t acked, long now, long srtt);  /* Not called in recovery */
+    void (*on_loss)(struct congestion *cc, uint32_t flight, long now);           /* Fast retransmit */
+    void (*on_timeout)(struct congestion *cc, uint32_t flight, long now);        /* Retransmission timeout */
+} congestion_ops_t;
+
+typedef struct congestion {
+    const congestion_ops_t* ops;
+    double cwnd;            /* Congestion window in packets */
+    double ssthresh;        /* Slow start threshold in packets */
+    double max_cwnd;        /* The window never grows beyond the sender's fixed window */
+    int in_recovery;        /* Fast recovery */
+    uint32_t recover;       /* Highest sequence number sent at the last reduction of the window */
+    uint64_t losses;        /* Loss events (fast retransmits starting a recovery) */
+    uint64_t timeouts;
+
+    /* CUBIC */
+    double w_max;           /* Window before the last reduction */
+    double k;               /* Time (s) the cubic function takes to grow back to w_max */
+    long epoch_start;       /* Start of the current congestion avoidance epoch (ms, 0 = none) */
+} congestion_t;
+
+/**
+ * Look up a congestion control algorithm by name.
+ *
+ * @param   name        Name of the algorithm ("none", "reno" (or "newreno") or "cubic")
+ *
+ * @return  Pointer to the algorithm's hooks (NULL if unknown)
+*/
+const congestion_ops_t* congestion_lookup(const char *name);
+
+/**
+ * Initialize the congestion control state of a connection.
+ *
+ * @param   cc          Pointer to congestion control state
+ * @param   ops         Pointer to the algorithm's hooks
+ * @param   max_cwnd    The sender's fixed window in packets
+*/
+void congestion_init(congestion_t *cc, const congestion_ops_t *ops, uint32_t max_cwnd);
+
+/**
+ * Account for an ACK that acknowledged new packets.
+ *
+ * @param   cc          Pointer to congestion control state
+ * @param   ackno       Cumulative acknowledgement number of the ACK
+ * @param   acked       Number of packets newly acknowledged
+ * @param   now         Current time in milliseconds
+ * @param   srtt        Smoothed round-trip time in milliseconds
+ *
+ * @return  1 if it is a partial ACK in recovery (the packet at ackno is lost too and should be resent),
+ *          0 otherwise
+*/
+int congestion_on_ack(congestion_t *cc, uint32_t ackno, uint32_t acked, long now, long srtt);
+
+/**
+ * Account for a loss detected by duplicate ACKs (no-op during recovery, or for packets sent before the last
+ * reduction of the window).
+ *
+ * @param   cc          Pointer to congestion control state
+ * @param   ackno       Cumulative acknowledgement number of the duplicate ACKs
+ * @param   flight      Number of packets in flight
+ * @param   highest     Highest sequence number sent so far
+ * @param   now         Current time in milliseconds
+*/
+void congestion_on_loss(congestion_t *cc, uint32_t ackno, uint32_t flight, uint32_t highest, long now);
+
+/**
+ * Account for a retransmission timeout.
+ *
+ * @param   cc          Pointer to congestion control state
+ * @param   flight      Number of packets in flight
+ * @param   highest     Highest sequence number sent so far
+ * @param   now         Current time in milliseconds
+*/
+void congestion_on_timeout(congestion_t *cc, uint32_t flight, uint32_t highest, long now);
+
+/**
+ * Get the congestion window.
+ *
+ * @param   cc          Pointer to congestion control state
+ *
+ * @return  Number of packets that may be in flight (at least 1)
+*/
+uint32_t congestion_window(congestion_t *cc);
+
+#endif /* CONGESTION_H */
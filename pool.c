@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "pool.h"
+#include "rlib.h"
+
+/**
+ * Allocate the slab of a size class and thread its free-list through it, lowest address first.
+ *
+ * @param   class           Pointer to the size class
+ * @param   object_size     Minimum size of each object in bytes
+ * @param   capacity        Number of objects preallocated in the slab
+*/
+static void class_init(pool_class_t *class, size_t object_size, uint32_t capacity) {
+    if (object_size < sizeof(pool_object_t)) {
+        object_size = sizeof(pool_object_t);
+    }
+    class->object_size = (object_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    class->capacity = capacity;
+    class->free_list = NULL;
+
+    void* slab = NULL;
+    if (capacity > 0 && posix_memalign(&slab, POOL_ALIGN, class->object_size * capacity) != 0) {
+        fprintf(stderr, "%s: out of memory allocating %d byte pool\n",
+                progname, (int)(class->object_size * capacity));
+        abort();
+    }
+    class->slab = slab;
+
+    for (uint32_t i = capacity; i > 0; i--) {
+        pool_object_t* object = (pool_object_t*)(class->slab + (i - 1) * class->object_size);
+        object->next = class->free_list;
+        class->free_list = object;
+    }
+}
+
+/**
+ * Allocate a pool and the slab of its smallest size class.
+ *
+ * @param   object_size     Minimum size of each object in bytes
+ * @param   capacity        Number of objects preallocated in the slab
+ *
+ * @return  Pointer to the new pool
+*/
+pool_t* pool_create(size_t object_size, uint32_t capacity) {
+    pool_t* pool = xmalloc(sizeof(pool_t));
+    pool->nclasses = 1;
+    pool->hits = 0;
+    pool->misses = 0;
+    class_init(&pool->classes[0], object_size, capacity);
+    pool->object_size = pool->classes[0].object_size;
+    return pool;
+}
+
+/**
+ * Add a size class of objects larger than those of all classes so far, and allocate its slab.
+ *
+ * @param   pool            Pointer to pool (with fewer than POOL_MAX_CLASSES classes)
+ * @param   object_size     Minimum size of each object in bytes
+ * @param   capacity        Number of objects preallocated in the slab
+*/
+void pool_add_class(pool_t *pool, size_t object_size, uint32_t capacity) {
+    if (pool->nclasses == POOL_MAX_CLASSES || object_size <= pool->classes[pool->nclasses - 1].object_size) {
+        fprintf(stderr, "%s: pool size classes must grow, at most %d of them\n", progname, POOL_MAX_CLASSES);
+        abort();
+    }
+    class_init(&pool->classes[pool->nclasses++], object_size, capacity);
+}
+
+/**
+ * Free the pool and its slabs. All objects must have been returned before.
+ *
+ * @param   pool        Pointer to pool
+*/
+void pool_destroy(pool_t *pool) {
+    for (int i = 0; i < pool->nclasses; i++) {
+        free(pool->classes[i].slab);
+    }
+    free(pool);
+}
+
+/**
+ * Get an object of the smallest class (contents undefined).
+ *
+ * @param   pool        Pointer to pool
+ *
+ * @return  Pointer to the object (never NULL)
+*/
+void* pool_get(pool_t *pool) {
+    pool_class_t* class = &pool->classes[0];
+    pool_object_t* object = class->free_list;
+    if (object == NULL) {
+        pool->misses++;
+        return xmalloc(class->object_size);
+    }
+    class->free_list = object->next;
+    pool->hits++;
+    return object;
+}
+
+/**
+ * Get an object of at least the given size (contents undefined), from the smallest class that holds it.
+ *
+ * @param   pool        Pointer to pool
+ * @param   size        Size needed in bytes
+ *
+ * @return  Pointer to the object (never NULL)
+*/
+void* pool_get_size(pool_t *pool, size_t size) {
+    for (int i = 0; i < pool->nclasses; i++) {
+        pool_class_t* class = &pool->classes[i];
+        if (class->object_size < size) {
+            continue;
+        }
+        pool_object_t* object = class->free_list;
+        if (object == NULL) {
+            pool->misses++;
+            return xmalloc(class->object_size);
+        }
+        class->free_list = object->next;
+        pool->hits++;
+        return object;
+    }
+    pool->misses++;
+    return xmalloc(size);
+}
+
+/**
+ * Get the size of the objects pool_get_size() returns for a size.
+ *
+ * @param   pool        Pointer to pool
+ * @param   size        Size needed in bytes
+ *
+ * @return  Object size of the smallest class that holds size (size itself if none does)
+*/
+size_t pool_class_size(pool_t *pool, size_t size) {
+    for (int i = 0; i < pool->nclasses; i++) {
+        if (pool->classes[i].object_size >= size) {
+            return pool->classes[i].object_size;
+        }
+    }
+    return size;
+}
+
+/**
+ * Return an object obtained by pool_get() or pool_get_size() to the pool.
+ *
+ * @param   pool        Pointer to pool
+ * @param   object      Pointer to object
+*/
+void pool_put(pool_t *pool, void *object) {
+    char* p = object;
+    for (int i = 0; i < pool->nclasses; i++) {
+        pool_class_t* class = &pool->classes[i];
+        if (p >= class->slab && p < class->slab + class->object_size * class->capacity) {
+            pool_object_t* o = object;
+            o->next = class->free_list;
+            class->free_list = o;
+            return;
+        }
+    }
+    free(object);
+}
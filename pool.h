@@ -0,0 +1,103 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A pool is a set of free-lists of preallocated objects (e.g. packets), one per size class.
+ *
+ * Each class carves its equally sized objects out of one cache-aligned slab that is allocated once (by
+ * pool_create() for the smallest class, pool_add_class() for larger ones), and every object starts on its own
+ * cache line. pool_get_size() pops an object off the free-list of the smallest class that holds the requested
+ * size (a hit); only when that free-list is exhausted, or no class is large enough, does it fall back to the
+ * heap (a miss). pool_put() returns slab objects to the free-list of their class and frees heap objects, so a
+ * pool sized for the steady state performs no malloc/free calls.
+*/
+
+#define POOL_ALIGN 64
+#define POOL_MAX_CLASSES 4
+
+typedef struct pool_object {
+    struct pool_object* next;
+} pool_object_t;
+
+typedef struct pool_class {
+    char* slab;
+    size_t object_size;     /* Size of each object, rounded up to POOL_ALIGN */
+    uint32_t capacity;      /* Number of objects in the slab */
+    pool_object_t* free_list;
+} pool_class_t;
+
+typedef struct pool {
+    pool_class_t classes[POOL_MAX_CLASSES];     /* By increasing object size */
+    int nclasses;
+    size_t object_size;     /* Object size of the smallest class (that of pool_get()) */
+    uint64_t hits;          /* pool_get() calls served from a slab */
+    uint64_t misses;        /* pool_get() calls that fell back to the heap */
+} pool_t;
+
+/**
+ * Allocate a pool and the slab of its smallest size class.
+ *
+ * @param   object_size     Minimum size of each object in bytes
+ * @param   capacity        Number of objects preallocated in the slab
+ *
+ * @return  Pointer to the new pool
+*/
+pool_t* pool_create(size_t object_size, uint32_t capacity);
+
+/**
+ * Add a size class of objects larger than those of all classes so far, and allocate its slab.
+ *
+ * @param   pool            Pointer to pool (with fewer than POOL_MAX_CLASSES classes)
+ * @param   object_size     Minimum size of each object in bytes
+ * @param   capacity        Number of objects preallocated in the slab
+*/
+void pool_add_class(pool_t *pool, size_t object_size, uint32_t capacity);
+
+/**
+ * Free the pool and its slabs. All objects must have been returned before.
+ *
+ * @param   pool        Pointer to pool
+*/
+void pool_destroy(pool_t *pool);
+
+/**
+ * Get an object of the smallest class (contents undefined).
+ *
+ * @param   pool        Pointer to pool
+ *
+ * @return  Pointer to the object (never NULL)
+*/
+void* pool_get(pool_t *pool);
+
+/**
+ * Get an object of at least the given size (contents undefined), from the smallest class that holds it.
+ *
+ * @param   pool        Pointer to pool
+ * @param   size        Size needed in bytes
+ *
+ * @return  Pointer to the object (never NULL)
+*/
+void* pool_get_size(pool_t *pool, size_t size);
+
+/**
+ * Get the size of the objects pool_get_size() returns for a size.
+ *
+ * @param   pool        Pointer to pool
+ * @param   size        Size needed in bytes
+ *
+ * @return  Object size of the smallest class that holds size (size itself if none does)
+*/
+size_t pool_class_size(pool_t *pool, size_t size);
+
+/**
+ * Return an object obtained by pool_get() or pool_get_size() to the pool.
+ *
+ * @param   pool        Pointer to pool
+ * @param   object      Pointer to object
+*/
+void pool_put(pool_t *pool, void *object);
+
+#endif /* POOL_H */
@@ -13,7 +13,49 @@
 #include <unistd.h>
 
 #include "buffer.h"
+#include "cksum.h"
+#include "congestion.h"
+#include "pool.h"
 #include "rlib.h"
+#include "timer.h"
+
+// RFC 6298 bounds of the retransmission timeout and clock granularity (ms), -t sets the initial RTO
+#define RTO_MIN 200
+#define RTO_MAX 60000
+#define RTO_GRANULARITY 1
+
+// RTOs (at most LINGER_MAX ms) a finished connection lingers to acknowledge the peer's retransmissions,
+// in case our last ACK was lost
+#define LINGER_RTOS 16
+#define LINGER_MAX 1000
+
+// Most in-order packets rel_output hands to rlib in one conn_outputv call, and rel_read reads ahead in one
+// conn_inputv call
+#define OUTPUT_BATCH 64
+#define INPUT_BATCH 64
+
+// timeouts of a packet after which we give up on it once the peer has sent its EOF and all its data has been
+// delivered: the peer may have taken our last ACK for everything and be gone already
+#define CLOSE_RETRIES 8
+
+// capabilities announced in our HELLO
+#define REL_CAPS (REL_CAP_SACK | REL_CAP_PIGGYBACK | REL_CAP_WINDOW | REL_CAP_PMTUD)
+
+// path MTU discovery (--pmtud): timeouts of a probe before its size counts as too large, how close (bytes) the
+// search gets to the largest size that makes it through before it settles, and when it searches again (ms) in
+// case the path changed (RFC 8899)
+#define PMTU_TRIES 3
+#define PMTU_RESOLUTION 64
+#define PMTU_REPROBE 600000
+
+// timeouts of a data packet above REL_MSS_DEFAULT after which the path is taken to have shrunk
+#define PMTU_BLACKHOLE 2
+
+// an extended ACK under construction
+typedef union ext_packet {
+    packet_t pkt;
+    char bytes[CONN_SMALL_PKT];
+} ext_packet_t;
 
 struct reliable_state {
     rel_t *next; /* Linked list for traversing all connections */
@@ -22,24 +64,110 @@ struct reliable_state {
     conn_t *c; /* This is the connection object */
 
     /* Add your own data fields below this */
+    pool_t *pool;  // packet pool of the connection, shared with rlib
     buffer_t *send_buffer;
     buffer_t *recv_buffer;
 
     uint64_t window_max_size;
     uint64_t window_size;  // semantically equal to buffer_size(r->send_buffer)
-    uint64_t retransmission_timer;
+    congestion_t congestion;  // the effective window is min(cwnd, window_max_size)
+    int resent_queued;  // a retransmission may still wait in rlib's send queue, which an ACK must not free
+
+    // retransmission timeout (ms), estimated from the RTT of packets that were never retransmitted
+    long srtt;
+    long rttvar;
+    long rto;
+    long rto_min;  // RTO_MIN, or the initial RTO if that is lower
+
+    // fast retransmit of the head of the window after dupack_threshold duplicate ACKs
+    uint32_t last_ackno;
+    uint32_t dupacks;
+    uint32_t dupack_threshold;
+    uint32_t recovery_resent;  // the holes below it went out again in the current recovery
+
+    // extended ACKs, negotiated with a HELLO
+    uint32_t peer_caps;  // REL_CAP_* announced by the peer
+    uint32_t mss;        // largest payload we take (announced in our HELLO)
+    uint32_t send_mss;   // payload of the packets we send: the smaller MSS, once the peer's HELLO told us
+    int peer_hello;      // the peer's HELLO has arrived
+    int hellos_sent;     // HELLO requests sent so far
+    long hello_sent;     // when the last one went out
+    int hello_ack_due;   // a peer that does not know HELLOs may still answer it with a plain ACK
+    timer_entry_t hello_timer;  // armed from our first HELLO request until the peer's HELLO arrives
+
+    // path MTU discovery: send_mss is pmtu_ok, the largest probe the peer answered, while probes narrow
+    // [pmtu_ok, pmtu_fail) down, up to pmtu_max, the MSS the peers agreed on (pmtu_fail is 0 until the first
+    // search starts, which it does once there is data to send)
+    int pmtud;
+    uint32_t pmtu_max;
+    uint32_t pmtu_ok;
+    uint32_t pmtu_fail;
+    uint32_t probe_size;        // payload size the probe in flight stands in for, 0 if none
+    int probe_tries;
+    packet_t *probe;            // the probe in flight, from the pool
+    timer_entry_t probe_timer;  // armed while a probe is in flight, or until the next search
+
+    // Nagle's algorithm (unless nodelay): a packet short of the MSS waits in pending, for more input to fill
+    // it, while the last short one sent (small_seqno) is unacknowledged, at most cork_timeout ms
+    int nodelay;
+    long cork_timeout;
+    packet_t *pending;
+    uint32_t pending_len;       // payload read into it so far
+    uint32_t pending_mss;       // payload it has room for
+    uint32_t small_seqno;       // 0 if none
+    int cork_expired;
+    timer_entry_t cork_timer;
+
+    // flow control: the peer's advertised window ends at peer_wnd_end (UINT32_MAX until it advertises one);
+    // while it is closed, the persist timer lets one packet through to learn when it opens, and resends that
+    // probe (probe_seqno, 0 if none) every persist_interval ms, doubling up to RTO_MAX, rather than its RTO
+    uint32_t peer_wnd_end;
+    int window_probe;
+    uint32_t probe_seqno;
+    long persist_interval;
+    timer_entry_t persist_timer;
 
     uint32_t current_seq_no;
     uint32_t current_ack_no;
+    uint32_t rcv_nxt;  // current_ack_no, plus the in-order run held in the receive buffer for output
 
     int outputBufferFull;
     int send_EOF;
     int recv_EOF;
+
+    timer_entry_t close_timer;  // armed once the connection is done (re-armed while the peer still sends)
+    timer_entry_t ack_timer;    // armed while an ACK for in-order data is owed
+
+    // delayed ACKs: in-order data is acknowledged every ack_every packets, or ack_delay ms after the first one
+    uint32_t ack_every;
+    long ack_delay;
+    uint32_t unacked;           // in-order packets received since our last ACK
+
+    // printed on destroy with --stats
+    uint64_t rtt_samples;
+    uint64_t timeout_retransmits;
+    uint64_t fast_retransmits;
+    uint64_t sacked;
+    uint64_t acks_sent;         // ACK and extended ACK packets (HELLOs aside)
+    uint64_t acks_piggybacked;  // owed ACKs that rode on a data packet instead
+    uint64_t data_received;     // data packets received, duplicates included
+    uint64_t window_stalls;     // times the peer's window closed with nothing in flight
+    uint64_t window_probes;
+    uint64_t data_sent;         // data packets sent (first transmissions, EOF aside)
+    uint64_t data_bytes;        // and their payload
+    uint64_t pmtu_probes;       // path MTU probes sent, retries included
+    uint64_t pmtu_lost;         // probes that timed out
+    uint64_t nagle_holds;       // short packets held back for more input
+    uint64_t cork_timeouts;     // held packets sent once the cork timeout expired
 };
-rel_t *rel_list;
+__thread rel_t *rel_list;
+
+// Retransmission timers of all buffered packets and close timers of all connections, by deadline
+static __thread timer_heap_t timers;
 
 /* Creates a new reliable protocol session, returns NULL on failure.
- * ss is always NULL */
+ * ss is NULL unless in server mode, where c is NULL and ss is the address
+ * of the peer whose first packet just arrived */
 rel_t *
 rel_create(conn_t *c, const struct sockaddr_storage *ss, const struct config_common *cc) {
     rel_t *r;
@@ -64,19 +192,39 @@ rel_create(conn_t *c, const struct sockaddr_storage *ss, const struct config_com
 
     /* Do any other initialization you need here... */
     // ...
-    r->send_buffer = xmalloc(sizeof(buffer_t));
-    r->send_buffer->head = NULL;
-
-    r->recv_buffer = xmalloc(sizeof(buffer_t));
-    r->recv_buffer->head = NULL;
+    r->pool = conn_pool(c);
+    r->send_buffer = buffer_create(cc->window, r->pool, &timers);
+    r->recv_buffer = buffer_create(cc->window, r->pool, NULL);
+    r->close_timer.arg = r;
+    r->ack_timer.arg = r;
+    r->persist_timer.arg = r;
+    r->probe_timer.arg = r;
+    r->cork_timer.arg = r;
+    r->hello_timer.arg = r;
+    r->nodelay = cc->nodelay;
+    r->cork_timeout = cc->cork_timeout;
+    r->mss = cc->mss;
+    r->send_mss = REL_MSS_DEFAULT;
+    r->pmtud = cc->pmtud;
+    r->pmtu_ok = REL_MSS_DEFAULT;
+    r->ack_every = cc->ack_every;
+    r->ack_delay = cc->ack_delay;
 
     r->window_max_size = cc->window;
     r->window_size = 0;
+    congestion_init(&r->congestion, congestion_lookup(cc->congestion), cc->window);
 
-    r->retransmission_timer = cc->timeout;
+    r->rto = cc->timeout;
+    r->rto_min = cc->timeout < RTO_MIN ? cc->timeout : RTO_MIN;
+
+    r->last_ackno = 1;
+    r->dupack_threshold = cc->dupacks;
+
+    r->peer_wnd_end = UINT32_MAX;
 
     r->current_seq_no = 1;
     r->current_ack_no = 1;
+    r->rcv_nxt = 1;
 
     r->outputBufferFull = 0;
     r->send_EOF = 0;
@@ -86,9 +234,9 @@ rel_create(conn_t *c, const struct sockaddr_storage *ss, const struct config_com
 }
 
 long getCurrentTime() {
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    long now_ms = now.tv_sec * 1000 + now.tv_usec / 1000;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long now_ms = now.tv_sec * 1000 + now.tv_nsec / 1000000;
     return now_ms;
 }
 
@@ -99,17 +247,338 @@ void rel_destroy(rel_t *r) {
     *r->prev = r->next;
     conn_destroy(r->c);
 
+    if (opt_stats) {
+        fprintf(stderr, "[stats] rtt: srtt %ld ms, rttvar %ld ms, rto %ld ms (%llu samples)\n",
+                r->srtt, r->rttvar, r->rto, (unsigned long long)r->rtt_samples);
+        fprintf(stderr, "[stats] retransmits: %llu on timeout, %llu fast, %llu spared by sack (peer caps %08x)\n",
+                (unsigned long long)r->timeout_retransmits, (unsigned long long)r->fast_retransmits,
+                (unsigned long long)r->sacked, r->peer_caps);
+        fprintf(stderr, "[stats] congestion: %s, cwnd %.1f, ssthresh %.1f, %llu losses, %llu timeouts\n",
+                r->congestion.ops->name, r->congestion.cwnd, r->congestion.ssthresh,
+                (unsigned long long)r->congestion.losses, (unsigned long long)r->congestion.timeouts);
+        uint64_t acks = r->acks_sent + r->acks_piggybacked;
+        fprintf(stderr, "[stats] acks: %llu sent, %llu piggybacked on data (%.0f%% fewer ACK packets),"
+                " %.2f ACK packets per data packet received\n",
+                (unsigned long long)r->acks_sent, (unsigned long long)r->acks_piggybacked,
+                acks ? 100.0 * r->acks_piggybacked / acks : 0.0,
+                r->data_received ? (double)r->acks_sent / r->data_received : 0.0);
+        fprintf(stderr, "[stats] flow control: %llu stalls on a closed window, %llu zero-window probes\n",
+                (unsigned long long)r->window_stalls, (unsigned long long)r->window_probes);
+        fprintf(stderr, "[stats] segments: %u bytes of payload%s, %llu data packets for %llu bytes (%.1f per MB),"
+                " %llu path MTU probes (%llu lost)\n",
+                r->send_mss, r->pmtud ? " (probed)" : "",
+                (unsigned long long)r->data_sent, (unsigned long long)r->data_bytes,
+                r->data_bytes ? r->data_sent * 1048576.0 / r->data_bytes : 0.0,
+                (unsigned long long)r->pmtu_probes, (unsigned long long)r->pmtu_lost);
+        fprintf(stderr, "[stats] nagle: %llu short packets held back, %llu sent on the cork timeout,"
+                " %.1f bytes of payload per data packet\n",
+                (unsigned long long)r->nagle_holds, (unsigned long long)r->cork_timeouts,
+                r->data_sent ? (double)r->data_bytes / r->data_sent : 0.0);
+    }
+
     /* Free any other allocated memory here */
-    buffer_clear(r->send_buffer);
-    free(r->send_buffer);
-    buffer_clear(r->recv_buffer);
-    free(r->recv_buffer);
-    // ...
+    timer_cancel(&timers, &r->close_timer);
+    timer_cancel(&timers, &r->ack_timer);
+    timer_cancel(&timers, &r->persist_timer);
+    timer_cancel(&timers, &r->probe_timer);
+    timer_cancel(&timers, &r->cork_timer);
+    timer_cancel(&timers, &r->hello_timer);
+    buffer_destroy(r->send_buffer);
+    buffer_destroy(r->recv_buffer);
+    if (r->probe != NULL) {
+        pool_put(r->pool, r->probe);
+    }
+    if (r->pending != NULL) {
+        pool_put(r->pool, r->pending);
+    }
+    free(r);
+}
+
+// before rel_destroy: EOF send, EOF received, send_buffer empty, output_buffer empty
+static void check_done(rel_t *r) {
+    if (buffer_size(r->send_buffer) == 0 && buffer_size(r->recv_buffer) == 0 && r->send_EOF && r->recv_EOF) {
+        // destroy from rel_timer, once the peer has had time to retransmit its EOF if our last ACK was lost
+        long linger = LINGER_RTOS * r->rto < LINGER_MAX ? LINGER_RTOS * r->rto : LINGER_MAX;
+        timer_arm(&timers, &r->close_timer, getCurrentTime() + linger);
+        timer_cancel(&timers, &r->hello_timer);
+    }
+}
+
+// the cumulative ackno we report: a peer that keeps to our window may have the packets we hold for output
+// acknowledged, as they are not counted in the window
+static uint32_t rcv_ackno(rel_t *r) {
+    return (r->peer_caps & REL_CAP_WINDOW) ? r->rcv_nxt : r->current_ack_no;
+}
+
+// the number of packets we have room for from rcv_nxt on: what is left of the receive buffer
+static uint32_t rcv_window(rel_t *r) {
+    return r->current_ack_no + r->window_max_size - r->rcv_nxt;
+}
+
+// number of packets that may be in flight
+static uint64_t rel_window(rel_t *r) {
+    uint64_t cwnd = congestion_window(&r->congestion);
+    return cwnd < r->window_max_size ? cwnd : r->window_max_size;
+}
+
+// update SRTT/RTTVAR with a new RTT measurement and recompute the RTO (RFC 6298, section 2)
+static void rtt_sample(rel_t *r, long rtt) {
+    if (r->rtt_samples == 0) {
+        r->srtt = rtt;
+        r->rttvar = rtt / 2;
+    } else {
+        long delta = r->srtt > rtt ? r->srtt - rtt : rtt - r->srtt;
+        r->rttvar = (3 * r->rttvar + delta) / 4;
+        r->srtt = (7 * r->srtt + rtt) / 8;
+    }
+    r->rtt_samples++;
+
+    long rto = r->srtt + (4 * r->rttvar > RTO_GRANULARITY ? 4 * r->rttvar : RTO_GRANULARITY);
+    if (rto < r->rto_min) {
+        rto = r->rto_min;
+    } else if (rto > RTO_MAX) {
+        rto = RTO_MAX;
+    }
+    r->rto = rto;
+}
+
+// send a packet that has been put into the send buffer and arm its retransmission timer
+static int send_buffered(rel_t *s, buffer_node_t *node, long now_ms) {
+    packet_t *packet = node->packet;
+
+    // a retransmission acknowledges what arrived since the packet was built; patch the checksum for the
+    // new ackno rather than summing the whole packet again
+    uint32_t ackno = htonl(rcv_ackno(s));
+    if (packet->ackno != ackno) {
+        packet->cksum = cksum_update(packet->cksum, &packet->ackno, &ackno, sizeof(ackno));
+        packet->ackno = ackno;
+    }
+
+    // to a peer that reads it, the ackno is the ACK we owe
+    if (timer_armed(&s->ack_timer) && (s->peer_caps & REL_CAP_PIGGYBACK)) {
+        timer_cancel(&timers, &s->ack_timer);
+        s->unacked = 0;
+        s->acks_piggybacked++;
+    }
+
+    int e = conn_sendpkt(s->c, packet, ntohs(packet->len));
+    s->resent_queued |= node->retransmits > 0;
+    node->last_retransmit = now_ms;
+    node->timer.arg = s;
+    timer_arm(&timers, &node->timer, now_ms + s->rto);
+    return e;
+}
+
+// append an option to an extended ACK under construction at offset off (from the start of the packet)
+static size_t ext_option(packet_t *pkt, size_t off, uint8_t kind, const void *value, uint8_t len) {
+    uint8_t *opt = (uint8_t *)pkt + off;
+    opt[0] = kind;
+    opt[1] = len + 2;
+    memcpy(opt + 2, value, len);
+    return off + 2 + len;
+}
+
+// checksum and send an extended ACK of length n (seqno 0, ackno = RCV.NXT)
+static int send_ext(rel_t *r, packet_t *pkt, size_t n) {
+    pkt->cksum = htons(0);
+    pkt->len = htons(n);
+    pkt->ackno = htonl(rcv_ackno(r));
+    pkt->seqno = htonl(0);
+    pkt->cksum = cksum(pkt, n);
+    print_pkt(pkt, "send extended ack", n);
+    return conn_sendpkt(r->c, pkt, n);
+}
+
+// announce our capabilities and MSS (flags is REL_CAP_HELLO_REPLY when answering the peer's HELLO)
+static void send_hello(rel_t *r, uint32_t flags) {
+    ext_packet_t ext;
+    uint32_t caps = htonl(REL_CAPS | flags);
+    uint32_t mss = htonl(r->mss);
+    size_t off = ext_option(&ext.pkt, 12, REL_OPT_HELLO, &caps, sizeof(caps));
+    send_ext(r, &ext.pkt, ext_option(&ext.pkt, off, REL_OPT_MSS, &mss, sizeof(mss)));
+}
+
+// ask for the peer's HELLO, and again on the hello timer, an RTO later and twice as long after each request
+// (up to RTO_MAX) until it arrives: either side's request or its reply may be lost
+static void send_hello_request(rel_t *r) {
+    long interval = r->rto;
+    for (int i = 0; i < r->hellos_sent && interval < RTO_MAX; i++) {
+        interval *= 2;
+    }
+    r->hellos_sent++;
+    r->hello_sent = getCurrentTime();
+    r->hello_ack_due = 1;
+    send_hello(r, 0);
+    timer_arm(&timers, &r->hello_timer, getCurrentTime() + (interval < RTO_MAX ? interval : RTO_MAX));
+}
+
+// start the HELLO exchange once we hear from the peer (a peer that never answers, e.g. because it is gone,
+// thus never sees anything but data)
+static void maybe_send_hello(rel_t *r) {
+    if (!r->peer_hello && !timer_armed(&r->hello_timer) && !timer_armed(&r->close_timer)) {
+        send_hello_request(r);
+    }
+}
+
+// the largest payload the path takes as far as the kernel knows (see conn_mtu), up to the MSS the peers agreed on
+static uint32_t pmtu_limit(rel_t *r) {
+    size_t mtu = conn_mtu(r->c);
+    if (mtu == 0 || mtu >= REL_PKT_SIZE(r->pmtu_max)) {
+        return r->pmtu_max;
+    }
+    return mtu > REL_PKT_SIZE(REL_MSS_DEFAULT) ? mtu - sizeof(packet_t) : REL_MSS_DEFAULT;
+}
+
+// (re)send the probe in flight, which times out after an RTO
+static void pmtu_send_probe(rel_t *r) {
+    r->pmtu_probes++;
+    send_ext(r, r->probe, REL_PKT_SIZE(r->probe_size));
+    timer_arm(&timers, &r->probe_timer, getCurrentTime() + r->rto);
+}
+
+// find out whether a data packet with size bytes of payload makes it to the peer: send an extended ACK that
+// long, zero-padded after its PROBE option (conn_sendpkt needs it until the send queue is flushed, so it is
+// kept until answered or given up on)
+static void pmtu_try(rel_t *r, uint32_t size) {
+    uint32_t value = htonl(size);
+    r->probe = pool_get_size(r->pool, REL_PKT_SIZE(size));
+    memset(r->probe, 0, REL_PKT_SIZE(size));
+    ext_option(r->probe, 12, REL_OPT_PROBE, &value, sizeof(value));
+    r->probe_size = size;
+    r->probe_tries = 0;
+    pmtu_send_probe(r);
+}
+
+static void pmtu_drop_probe(rel_t *r) {
+    timer_cancel(&timers, &r->probe_timer);
+    if (r->probe != NULL) {
+        conn_flush(r->c);
+        pool_put(r->pool, r->probe);
+        r->probe = NULL;
+    }
+    r->probe_size = 0;
+}
+
+// go on with the search (or start it over if restart): try the largest size the path may take first, then
+// halve the range between the largest size that made it through and the smallest that did not, until it is
+// narrow enough to settle for the former until PMTU_REPROBE, when the search starts over
+static void pmtu_next(rel_t *r, int restart) {
+    // sizes the kernel knows to be too large fail with EMSGSIZE, no need to probe them
+    uint32_t limit = pmtu_limit(r);
+    if (restart || r->pmtu_fail > limit + 1) {
+        r->pmtu_fail = limit + 1;
+    }
+    if (r->pmtu_ok > limit) {
+        r->pmtu_ok = REL_MSS_DEFAULT;
+        r->send_mss = REL_MSS_DEFAULT;
+    }
+    if (r->send_EOF) {
+        return;
+    }
+    if (r->pmtu_fail - r->pmtu_ok <= PMTU_RESOLUTION) {
+        timer_arm(&timers, &r->probe_timer, getCurrentTime() + PMTU_REPROBE);
+        return;
+    }
+    pmtu_try(r, restart ? limit : r->pmtu_ok + (r->pmtu_fail - r->pmtu_ok) / 2);
+}
+
+// the peer answered a probe: packets of its size make it through (answers to probes given up on are ignored)
+static void pmtu_on_ack(rel_t *r, uint32_t size) {
+    if (size == 0 || size != r->probe_size) {
+        return;
+    }
+    pmtu_drop_probe(r);
+    r->pmtu_ok = size;
+    r->send_mss = size;
+    pmtu_next(r, 0);
+}
+
+// the probe timer went off: retry the probe in flight, give up on its size, or start the next search
+static void pmtu_on_timeout(rel_t *r) {
+    if (r->probe_size == 0) {
+        pmtu_next(r, 1);
+        return;
+    }
+    r->pmtu_lost++;
+    if (++r->probe_tries < PMTU_TRIES) {
+        pmtu_send_probe(r);
+        return;
+    }
+    r->pmtu_fail = r->probe_size;
+    pmtu_drop_probe(r);
+    pmtu_next(r, 0);
+}
+
+// a data packet above REL_MSS_DEFAULT keeps timing out: the path may have shrunk without an ICMP message to
+// tell, so send no larger packets than REL_MSS_DEFAULT until a new search finds more (packets are numbered,
+// so those already sent cannot be split and go on as they are)
+static void pmtu_blackhole(rel_t *r) {
+    if (r->send_mss == REL_MSS_DEFAULT) {
+        return;
+    }
+    pmtu_drop_probe(r);
+    r->pmtu_ok = REL_MSS_DEFAULT;
+    r->send_mss = REL_MSS_DEFAULT;
+    pmtu_next(r, 1);
+}
+
+// answer a probe of the peer with its value
+static void send_probe_ack(rel_t *r, const uint8_t *value) {
+    ext_packet_t ext;
+    send_ext(r, &ext.pkt, ext_option(&ext.pkt, 12, REL_OPT_PROBE_ACK, value, sizeof(uint32_t)));
+}
+
+// advertise our window and report the packets held above RCV.NXT, as far as the peer understands either
+// (returns 0 if there is nothing to tell, so a plain ACK will do)
+static int send_ext_ack(rel_t *r) {
+    ext_packet_t ext;
+    size_t off = 12;
+    uint32_t ackno = rcv_ackno(r);
+
+    if (r->peer_caps & REL_CAP_WINDOW) {
+        uint32_t window = htonl(rcv_window(r));
+        off = ext_option(&ext.pkt, off, REL_OPT_WINDOW, &window, sizeof(window));
+    }
+
+    if (r->peer_caps & REL_CAP_SACK) {
+        // the bitmap reaches 8 * REL_SACK_MAX_BYTES packets above ackno, whatever the window (see rlib.h)
+        uint8_t bitmap[REL_SACK_MAX_BYTES];
+        size_t len = 0;
+        memset(bitmap, 0, sizeof(bitmap));
+        for (buffer_node_t *node = buffer_get_first(r->recv_buffer); node != NULL; node = buffer_next(r->recv_buffer, node)) {
+            if (node->seqno <= ackno) {
+                continue;
+            }
+            uint32_t bit = node->seqno - ackno - 1;
+            if (bit >= 8 * REL_SACK_MAX_BYTES) {
+                break;
+            }
+            bitmap[bit / 8] |= 1 << (bit % 8);
+            len = bit / 8 + 1;
+        }
+        if (len > 0) {
+            off = ext_option(&ext.pkt, off, REL_OPT_SACK, bitmap, len);
+        }
+    }
+
+    if (off == 12) {
+        return 0;
+    }
+    send_ext(r, &ext.pkt, off);
+    return 1;
 }
 
 void send_ack(rel_t *r) {
-    if (!r->outputBufferFull) {
-        uint32_t ackno = r->current_ack_no;
+    timer_cancel(&timers, &r->ack_timer);
+    r->unacked = 0;
+    // with the output buffer full, the ACK is withheld unless the window it carries tells the peer to wait
+    if (!r->outputBufferFull || (r->peer_caps & REL_CAP_WINDOW)) {
+        r->acks_sent++;
+        if (send_ext_ack(r)) {
+            return;
+        }
+
+        uint32_t ackno = rcv_ackno(r);
         struct ack_packet ack_pkt = {htons(0), htons(8), htonl(ackno)};
         ack_pkt.cksum = cksum(&ack_pkt, 8);
 
@@ -124,12 +593,213 @@ void send_ack(rel_t *r) {
     }
 }
 
-// n is the length of the pkt
+// owe an ACK for an in-order packet, due ack_delay ms after the first unacknowledged one, or with ack_every of
+// them as soon as the current events are handled: a data packet we send until then carries it, otherwise the
+// ack timer sends it
+static void defer_ack(rel_t *r) {
+    long deadline = getCurrentTime() + (++r->unacked >= r->ack_every ? 0 : r->ack_delay);
+    if (!timer_armed(&r->ack_timer) || deadline < r->ack_timer.deadline) {
+        timer_arm(&timers, &r->ack_timer, deadline);
+    }
+}
+
+// the probe of a closed window is done once acknowledged; once the window takes it, the receiver dropped it,
+// and it is resent right away as an ordinary packet (with an RTO)
+static void probe_check(rel_t *r) {
+    if (r->probe_seqno == 0) {
+        return;
+    }
+    buffer_node_t *node = buffer_get(r->send_buffer, r->probe_seqno);
+    if (node != NULL && r->probe_seqno >= r->peer_wnd_end) {
+        return;
+    }
+    r->probe_seqno = 0;
+    timer_cancel(&timers, &r->persist_timer);
+    if (node != NULL && !node->sacked) {
+        node->retransmits++;
+        send_buffered(r, node, getCurrentTime());
+    }
+}
+
+// the persist timer went off: resend the probe in flight, or let a new one through, and back off
+static void persist_on_timeout(rel_t *r, long now_ms) {
+    buffer_node_t *node = r->probe_seqno ? buffer_get(r->send_buffer, r->probe_seqno) : NULL;
+    r->persist_interval = 2 * r->persist_interval < RTO_MAX ? 2 * r->persist_interval : RTO_MAX;
+    if (node == NULL) {
+        r->probe_seqno = 0;
+        r->window_probe = 1;
+        rel_read(r);
+        return;
+    }
+    r->window_probes++;
+    node->retransmits++;
+    send_buffered(r, node, now_ms);
+    timer_cancel(&timers, &node->timer);
+    timer_arm(&timers, &r->persist_timer, now_ms + r->persist_interval);
+}
+
+// process a cumulative ackno and the bitmap of packets the receiver holds above it (sack_len bytes);
+// window_update is non-zero if the ACK opened the peer's window
+static void handle_ack(rel_t *r, uint32_t ackno, const uint8_t *sack, size_t sack_len, int window_update) {
+    // an ACK overtaken by a later one tells nothing new (and must not move last_ackno back, or the next
+    // duplicate would go uncounted), and one beyond what we sent is bogus; the window it opened still counts
+    if (ackno < r->last_ackno || ackno > r->current_seq_no) {
+        if (window_update) {
+            rel_read(r);
+        }
+        return;
+    }
+
+    // time the newest acknowledged packet, unless it was retransmitted (Karn's algorithm) or SACKed
+    // earlier (the cumulative ACK for it then only tells when the hole below it was filled)
+    buffer_node_t *acked = buffer_get(r->send_buffer, ackno - 1);
+    if (acked != NULL && acked->retransmits == 0 && !acked->sacked) {
+        rtt_sample(r, getCurrentTime() - acked->last_retransmit);
+    }
+
+    // the send queue holds new packets by reference until the current callback returns, and may hold a
+    // retransmission that this ACK covers: get it out before the packet goes back to the pool
+    if (r->resent_queued) {
+        conn_flush(r->c);
+        r->resent_queued = 0;
+    }
+    int w = buffer_remove(r->send_buffer, ackno);
+    r->window_size -= w;
+    // NewReno (RFC 6582): an ACK that leaves a recovery unfinished asks for a packet that was lost too;
+    // resend it now rather than wait for more duplicates or its RTO, unless it went out in this recovery
+    if (w > 0 && congestion_on_ack(&r->congestion, ackno, w, getCurrentTime(), r->srtt)
+        && ackno >= r->recovery_resent) {
+        buffer_node_t *hole = buffer_get(r->send_buffer, ackno);
+        r->recovery_resent = ackno + 1;
+        if (hole != NULL && !hole->sacked && ackno != r->probe_seqno) {
+            hole->retransmits++;
+            r->fast_retransmits++;
+            send_buffered(r, hole, getCurrentTime());
+        }
+    }
+    probe_check(r);
+
+    // packets the receiver already holds need no retransmission
+    uint32_t highest_sacked = 0;
+    for (uint32_t i = 0; i < 8 * sack_len; i++) {
+        if (!(sack[i / 8] & (1 << (i % 8)))) {
+            continue;
+        }
+        highest_sacked = ackno + 1 + i;
+        buffer_node_t *node = buffer_get(r->send_buffer, highest_sacked);
+        if (node != NULL && !node->sacked) {
+            node->sacked = 1;
+            timer_cancel(&timers, &node->timer);
+            r->sacked++;
+        }
+    }
+
+    // the receiver repeats its ackno for every packet after a hole: resend the hole right away,
+    // along with the other holes below the highest SACKed packet (window updates and answers to probes of a
+    // closed window are no such repetitions)
+    if (w > 0 || ackno != r->last_ackno || window_update || ackno >= r->peer_wnd_end) {
+        r->last_ackno = ackno;
+        r->dupacks = 0;
+    } else if (r->hello_ack_due && sack == NULL && getCurrentTime() - r->hello_sent <= r->rto) {
+        // a peer that does not know HELLOs takes ours for a packet out of its window, and answers it with
+        // its current ackno: no sign of loss
+        r->hello_ack_due = 0;
+    } else if (buffer_size(r->send_buffer) > 0 && ++r->dupacks == r->dupack_threshold) {
+        long now_ms = getCurrentTime();
+        congestion_on_loss(&r->congestion, ackno, r->window_size, r->current_seq_no - 1, now_ms);
+        uint32_t seqno = ackno;
+        do {
+            buffer_node_t *hole = buffer_get(r->send_buffer, seqno);
+            if (hole != NULL && !hole->sacked && seqno != r->probe_seqno) {
+                hole->retransmits++;
+                r->fast_retransmits++;
+                send_buffered(r, hole, now_ms);
+            }
+        } while (++seqno < highest_sacked);
+        r->recovery_resent = seqno;
+    }
+    rel_read(r);
+    check_done(r);
+}
+
+// process the ackno of a data packet, which acknowledges like an ACK but never counts as a duplicate
+// (RFC 5681): only new acknowledgements of packets we did send are taken, whatever the peer announced (it
+// may have learned our capabilities while we have not learned its own, and rely on its acknos alone)
+static void handle_piggyback(rel_t *r, uint32_t ackno) {
+    if (ackno > r->last_ackno && ackno <= r->current_seq_no) {
+        handle_ack(r, ackno, NULL, 0, 0);
+    }
+}
+
+// process the options of an extended ACK of length n
+static void handle_ext(rel_t *r, packet_t *pkt, size_t n) {
+    const uint8_t *sack = NULL;
+    size_t sack_len = 0;
+    int has_window = 0;
+    int window_update = 0;
+    const uint8_t *opt = (const uint8_t *)pkt + 12;
+    const uint8_t *end = (const uint8_t *)pkt + n;
+    while (end - opt >= 2 && opt[1] >= 2 && opt[1] <= end - opt) {
+        const uint8_t *value = opt + 2;
+        size_t value_len = opt[1] - 2;
+        if (opt[0] == REL_OPT_HELLO && value_len == sizeof(uint32_t)) {
+            uint32_t caps;
+            memcpy(&caps, value, sizeof(caps));
+            caps = ntohl(caps);
+            r->peer_caps = caps & ~REL_CAP_HELLO_REPLY;
+            r->peer_hello = 1;
+            r->hello_ack_due = 0;
+            timer_cancel(&timers, &r->hello_timer);
+            if (!(caps & REL_CAP_HELLO_REPLY)) {
+                send_hello(r, REL_CAP_HELLO_REPLY);
+            }
+        } else if (opt[0] == REL_OPT_MSS && value_len == sizeof(uint32_t)) {
+            uint32_t mss;
+            memcpy(&mss, value, sizeof(mss));
+            mss = ntohl(mss);
+            if (mss >= REL_MSS_DEFAULT) {
+                // with --pmtud, probes find out how much of it the path takes
+                mss = mss < r->mss ? mss : r->mss;
+                if (r->pmtud) {
+                    r->pmtu_max = mss;
+                } else {
+                    r->send_mss = mss;
+                }
+            }
+        } else if (opt[0] == REL_OPT_PROBE && value_len == sizeof(uint32_t)) {
+            send_probe_ack(r, value);
+        } else if (opt[0] == REL_OPT_PROBE_ACK && value_len == sizeof(uint32_t)) {
+            uint32_t size;
+            memcpy(&size, value, sizeof(size));
+            pmtu_on_ack(r, ntohl(size));
+        } else if (opt[0] == REL_OPT_SACK) {
+            sack = value;
+            sack_len = value_len;
+        } else if (opt[0] == REL_OPT_WINDOW && value_len == sizeof(uint32_t)) {
+            // the end of the window only moves forward, whatever order the ACKs arrive in
+            uint32_t window;
+            memcpy(&window, value, sizeof(window));
+            uint32_t end = ntohl(pkt->ackno) + ntohl(window);
+            has_window = 1;
+            if (r->peer_wnd_end == UINT32_MAX || end > r->peer_wnd_end) {
+                window_update = r->peer_wnd_end != UINT32_MAX;
+                r->peer_wnd_end = end;
+            }
+        }
+        opt += opt[1];
+    }
+    if (sack != NULL || has_window) {
+        handle_ack(r, ntohl(pkt->ackno), sack, sack_len, window_update);
+    }
+}
+
+// n is the length of the pkt, pkt is owned by us (drawn from r->pool)
 void rel_recvpkt(rel_t *r, packet_t *pkt, size_t n) {
     // catch impossible packets
     uint16_t len = ntohs(pkt->len);
     if ((n != 8 && n < 12) || len != (uint16_t)n) {
         fprintf(stderr, "error: impossible packet size\n");
+        pool_put(r->pool, pkt);
         return;
     }
 
@@ -139,31 +809,40 @@ void rel_recvpkt(rel_t *r, packet_t *pkt, size_t n) {
     // catch corrupted packets
     if (cksum(pkt, n) != checksum) {
         fprintf(stderr, "error: corrupted paket\n");
+        pool_put(r->pool, pkt);
         return;
     }
+    maybe_send_hello(r);
 
     // ACK PACKET
     if (n == 8) {
-        int w = buffer_remove(r->send_buffer, ntohl(pkt->ackno));
-        r->window_size -= w;
         print_pkt(pkt, "sender: got ack", 8);
-        rel_read(r);
+        handle_ack(r, ntohl(pkt->ackno), NULL, 0, 0);
+        pool_put(r->pool, pkt);
         return;
     }
 
-    // drop packet if out of window
+    // EXTENDED ACK PACKET
+    if (ntohl(pkt->seqno) == 0) {
+        print_pkt(pkt, "sender: got extended ack", n);
+        handle_ext(r, pkt, n);
+        pool_put(r->pool, pkt);
+        return;
+    }
+
+    // drop packet if out of window (its ackno is still good)
     uint32_t seqno = ntohl(pkt->seqno);
+    uint32_t ackno = ntohl(pkt->ackno);
+    r->data_received++;
     if (seqno < r->current_ack_no || r->current_ack_no + r->window_max_size <= seqno) {
         print_pkt(pkt, "receiver: got pkt out of window", n);
+        pool_put(r->pool, pkt);
+        handle_piggyback(r, ackno);
         send_ack(r);
+        check_done(r);
         return;
     }
 
-    // Store in the buffer if not already there
-    if (!buffer_contains(r->recv_buffer, seqno)) {
-        buffer_insert(r->recv_buffer, pkt, 0);
-    }
-
     // EOF PACKET
     if (n == 12) {
         r->recv_EOF = 1;
@@ -172,84 +851,205 @@ void rel_recvpkt(rel_t *r, packet_t *pkt, size_t n) {
         print_pkt(pkt, "receiver: got packet", n);
     }
 
+    // Store in the buffer (handing it the packet) if not already there
+    if (buffer_contains(r->recv_buffer, seqno) || buffer_insert(r->recv_buffer, pkt, 0) != 0) {
+        pool_put(r->pool, pkt);
+    }
+    pkt = NULL;
+    while (buffer_contains(r->recv_buffer, r->rcv_nxt)) {
+        r->rcv_nxt++;
+    }
+
     // NORMAL DATA PACKET
 
     // Release data [seqno, RCV.NXT - 1] with rel_output()
+    int gap_filled = 0;
     if (seqno == r->current_ack_no) {
+        gap_filled = buffer_size(r->recv_buffer) > 1;
         rel_output(r);
     }
 
-    // Send back ACK with cumulative ackno = RCV.NXT
-    send_ack(r);
+    // Send back ACK with cumulative ackno = RCV.NXT: for data delivered in order, delayed (and maybe riding on
+    // our next data packet); right away, in a packet of its own, for anything out of order (only those count
+    // as duplicate ACKs), a filled gap or the EOF
+    if (buffer_size(r->recv_buffer) == 0 && !gap_filled && !r->recv_EOF) {
+        defer_ack(r);
+    } else {
+        send_ack(r);
+    }
+
+    // the data this lets us send carries the ACK
+    handle_piggyback(r, ackno);
+    check_done(r);
 }
 
-void rel_read(rel_t *s) {
-    while (s->window_size < s->window_max_size && !s->send_EOF) {
-        // get data from stdin
-        char *buf = xmalloc(500);
-        int data_size = conn_input(s->c, buf, 500);
-        if (data_size == 0)  // no data currently available
-        {
-            free(buf);
-            return;
-        } else if (data_size == -1)  // EOF
-        {
-            // create packet with header
-            packet_t *p = xmalloc(sizeof(packet_t));
-            p->cksum = htons(0);
-            p->len = htons(12);
-            p->ackno = htonl(s->current_ack_no);
-            p->seqno = htonl(s->current_seq_no);
-
-            // calc checksum (already in network order)
-            p->cksum = cksum(p, 12);
-
-            // send packet
-            int e = conn_sendpkt(s->c, p, 12);
-            if (e == -1 || e != 12) {
-                fprintf(stderr, "error: could not send pkg\n");
-                return;
-            }
+// Nagle's algorithm: a packet short of the MSS waits while the last short one is unacknowledged (until the
+// cork timeout expires), so that trickling input goes out in few packets rather than one per read
+static int nagle_hold(rel_t *s) {
+    return !s->nodelay && !s->cork_expired && s->small_seqno != 0 && buffer_contains(s->send_buffer, s->small_seqno);
+}
 
-            s->send_EOF = 1;
+// fill in the header around the payload of a new data packet (an EOF if data_size is 0) and send it; the send
+// buffer takes over the packet
+static int send_data(rel_t *s, packet_t *p, int data_size, int probe) {
+    p->cksum = htons(0);
+    p->len = htons(data_size + 12);
+    p->ackno = htonl(rcv_ackno(s));
+    p->seqno = htonl(s->current_seq_no);
+
+    // calc checksum (already in network order)
+    p->cksum = cksum(p, data_size + 12);
+
+    // update state, the send buffer takes over the packet
+    long now_ms = getCurrentTime();
+    buffer_insert(s->send_buffer, p, now_ms);
+    s->window_size++;
+    s->current_seq_no++;
+    s->window_probe = 0;
+    timer_cancel(&timers, &s->persist_timer);
 
-            free(buf);
-            buf = NULL;
+    // send packet
+    buffer_node_t *node = buffer_get(s->send_buffer, ntohl(p->seqno));
+    int e = send_buffered(s, node, now_ms);
+    if (probe) {
+        // resent on the persist timer until acknowledged or taken by the window, the probe keeps asking from
+        // here on; its loss says nothing about congestion
+        s->window_probes++;
+        s->probe_seqno = node->seqno;
+        timer_cancel(&timers, &node->timer);
+        timer_arm(&timers, &s->persist_timer, now_ms + s->persist_interval);
+    }
+    if (e == -1 || e != data_size + 12) {
+        fprintf(stderr, "error: could not send pkg\n");
+        return -1;
+    }
+    print_pkt(p, s->send_EOF ? "sender: send EOF" : "sender: send pkt", data_size + 12);
+    return 0;
+}
 
-            print_pkt(p, "sender: send EOF", 12);
+// the packet held back for more input goes out: stop its cork timer
+static void cork_done(rel_t *s) {
+    s->cork_timeouts += s->cork_expired;
+    s->cork_expired = 0;
+    timer_cancel(&timers, &s->cork_timer);
+}
+
+void rel_read(rel_t *s) {
+    while (s->window_size < rel_window(s) && !s->send_EOF) {
+        // keep to the peer's window, but for one probe once the persist timer went off: with nothing in
+        // flight, no ACK would come to tell us when it opens
+        int probe = s->current_seq_no >= s->peer_wnd_end;
+        if (probe && !s->window_probe) {
+            if (s->window_size == 0 && !timer_armed(&s->persist_timer)) {
+                s->window_stalls++;
+                s->persist_interval = s->rto;
+                timer_arm(&timers, &s->persist_timer, getCurrentTime() + s->persist_interval);
+            }
             return;
         }
 
-        // create packet with header
-        packet_t *p = xmalloc(sizeof(packet_t));
-        p->cksum = htons(0);
-        p->len = htons(data_size + 12);
-        p->ackno = htonl(s->current_ack_no);
-        p->seqno = htonl(s->current_seq_no);
-        for (int i = 0; i < data_size; i++) {
-            p->data[i] = buf[i];
+        // read ahead as many packets as the windows let through (one for a probe) with a single conn_inputv
+        // call, directly into the payloads of pool packets: the one held back for more input first, if any
+        uint32_t room = probe ? 1 : rel_window(s) - s->window_size;
+        if (s->peer_wnd_end - s->current_seq_no < room) {
+            room = s->peer_wnd_end - s->current_seq_no;
         }
+        if (room > INPUT_BATCH) {
+            room = INPUT_BATCH;
+        }
+        packet_t *pkts[INPUT_BATCH];
+        struct iovec iov[INPUT_BATCH];
+        uint32_t mss0 = s->send_mss;  // payload the first packet has room for
+        uint32_t held = 0;
+        int n;
+        if (s->pending != NULL) {
+            pkts[0] = s->pending;
+            held = s->pending_len;
+            mss0 = s->pending_mss < mss0 ? s->pending_mss : mss0;
+            s->pending = NULL;
+        } else {
+            pkts[0] = pool_get_size(s->pool, REL_PKT_SIZE(mss0));
+        }
+        iov[0].iov_base = pkts[0]->data + held;
+        iov[0].iov_len = held < mss0 ? mss0 - held : 0;
+        for (n = 1; n < room; n++) {
+            pkts[n] = pool_get_size(s->pool, REL_PKT_SIZE(s->send_mss));
+            iov[n].iov_base = pkts[n]->data;
+            iov[n].iov_len = s->send_mss;
+        }
+        // bytes read, 0 if no data is currently available, -1 on EOF
+        int r = (iov[0].iov_len > 0 || n > 1) ? conn_inputv(s->c, iov, n) : 0;
 
-        free(buf);
-        buf = NULL;
+        // cut what was read into packets, returning those left empty to the pool
+        int data_size[INPUT_BATCH];
+        size_t left = r > 0 ? r : 0;
+        int filled = 0;
+        for (int i = 0; i < n; i++) {
+            size_t len = iov[i].iov_len < left ? iov[i].iov_len : left;
+            left -= len;
+            data_size[i] = (i == 0 ? held : 0) + len;
+            if (data_size[i] > 0) {
+                filled = i + 1;
+            }
+        }
+        for (int i = filled > 0 ? filled : 1; i < n; i++) {
+            pool_put(s->pool, pkts[i]);
+        }
+        if (filled == 0) {
+            if (r == 0) {  // no data currently available
+                pool_put(s->pool, pkts[0]);
+                return;
+            }
+            // an EOF is a data packet without payload (retransmitted until acknowledged); one that follows data
+            // read goes out next time around
+            s->send_EOF = 1;
+            if (timer_armed(&s->cork_timer) || s->cork_expired) {
+                cork_done(s);
+            }
+            send_data(s, pkts[0], 0, probe);
+            break;
+        }
 
-        // calc checksum (already in network order)
-        p->cksum = cksum(p, data_size + 12);
+        // the last packet is short if input ran dry: Nagle's algorithm may hold it back for more
+        uint32_t last_mss = filled == 1 ? mss0 : s->send_mss;
+        int dry = data_size[filled - 1] < last_mss;
+        int hold = dry && r >= 0 && nagle_hold(s);
+        for (int i = 0; i < filled - hold; i++) {
+            uint32_t mss = i == 0 ? mss0 : s->send_mss;
+            s->data_sent++;
+            s->data_bytes += data_size[i];
+            if (data_size[i] < mss) {
+                s->small_seqno = s->current_seq_no;
+            }
+            if (i == 0 && held > 0) {
+                cork_done(s);
+            }
+            if (send_data(s, pkts[i], data_size[i], probe) != 0) {
+                for (i++; i < filled; i++) {
+                    pool_put(s->pool, pkts[i]);
+                }
+                return;
+            }
+        }
+        if (hold) {
+            if (!timer_armed(&s->cork_timer)) {
+                s->nagle_holds++;
+                timer_arm(&timers, &s->cork_timer, getCurrentTime() + s->cork_timeout);
+            }
+            s->pending = pkts[filled - 1];
+            s->pending_len = data_size[filled - 1];
+            s->pending_mss = last_mss;
+        }
 
-        // send packet
-        int e = conn_sendpkt(s->c, p, data_size + 12);
-        if (e == -1 || e != data_size + 12) {
-            fprintf(stderr, "error: could not send pkg\n");
+        // search for the largest packets the path takes once there is data to send in them
+        if (filled > hold && s->pmtud && s->pmtu_fail == 0 && s->pmtu_max > REL_MSS_DEFAULT && (s->peer_caps & REL_CAP_PMTUD)) {
+            pmtu_next(s, 1);
+        }
+        if (dry && r >= 0) {
             return;
         }
-
-        // update state
-        buffer_insert(s->send_buffer, p, getCurrentTime());
-        s->window_size++;
-        s->current_seq_no++;
-        print_pkt(p, "sender: send pkt", data_size + 12);
     }
-    if (s->window_size >= s->window_max_size) {
+    if (s->window_size >= rel_window(s)) {
         fprintf(stderr, "info sender: window full\n");
     } else {
         fprintf(stderr, "info sender: EOF read\n");
@@ -258,67 +1058,131 @@ void rel_read(rel_t *s) {
 }
 
 void rel_output(rel_t *r) {
-    buffer_node_t *node = buffer_get_first(r->recv_buffer);
-    if (node == NULL) {
-        return;
-    }
-    size_t data_size = ntohs(node->packet.len) - 12;
-    void *buf = &node->packet.data;
+    // release the in-order run at the head of the receive buffer (never across a gap), as many packets per
+    // conn_outputv call as fit in the output buffer
+    int was_full = r->outputBufferFull;
+    uint32_t ack_no = r->current_ack_no;
+    buffer_node_t *node;
+    while ((node = buffer_get_first(r->recv_buffer)) != NULL && node->seqno == r->current_ack_no) {
+        struct iovec iov[OUTPUT_BATCH];
+        size_t space = conn_bufspace(r->c);
+        size_t total = 0;
+        int n = 0;
 
-    // check if output_buf has space
-    if (data_size <= conn_bufspace(r->c)) {
-        int e = conn_output(r->c, buf, data_size);
-        if (e == -1 || e != data_size) {
+        // gather up to the EOF, which goes out on its own
+        for (; node != NULL && node->seqno == r->current_ack_no + n && n < OUTPUT_BATCH;
+             node = buffer_next(r->recv_buffer, node)) {
+            size_t data_size = ntohs(node->packet->len) - 12;
+            if (data_size == 0 || total + data_size > space) {
+                break;
+            }
+            iov[n].iov_base = node->packet->data;
+            iov[n].iov_len = data_size;
+            total += data_size;
+            n++;
+        }
+
+        int e;
+        if (n > 0) {
+            e = conn_outputv(r->c, iov, n);
+        } else if (ntohs(node->packet->len) == 12) {
+            e = conn_output(r->c, NULL, 0);
+            n = 1;
+        } else {
+            // no space in the output buffer for the next packet
+            r->outputBufferFull = 1;
+            return;
+        }
+        if (e == -1 || e != total) {
             fprintf(stderr, "error: could not send pkg\n");
             return;
         }
-        r->current_ack_no++;
-        buf = NULL;
 
-        e = buffer_remove_first(r->recv_buffer);
-        if (e != 0) {
-            fprintf(stderr, "error: could not remove node form buffer\n");
-            return;
+        for (int i = 0; i < n; i++) {
+            r->current_ack_no++;
+            if (buffer_remove_first(r->recv_buffer) != 0) {
+                fprintf(stderr, "error: could not remove node form buffer\n");
+                return;
+            }
         }
         r->outputBufferFull = 0;
-    } else {
-        r->outputBufferFull = 1;
     }
 
+    // the ACKs withheld while the output buffer was full: the sender waits for this one to go on
+    if (was_full && !r->outputBufferFull && r->current_ack_no != ack_no) {
+        send_ack(r);
+    }
+    check_done(r);
+
     return;
 }
 
 void rel_timer() {
-    // Go over all reliable senders, and have them send out
-    // all packets whose timer has expired
-    rel_t *current = rel_list;
-    while (current != NULL) {
-        buffer_node_t *current_node = buffer_get_first(current->send_buffer);
-        uint64_t retransmission_timer = current->retransmission_timer;
-
-        // go over window (alternatively go over window size)
-        while (current_node != NULL) {
-            long now_ms = getCurrentTime();
-            if (now_ms - current_node->last_retransmit > retransmission_timer) {
-                // retransmit packet
-                packet_t *packet = &current_node->packet;
-                int e = conn_sendpkt(current->c, packet, ntohs(packet->len));
-                if (e == -1 || e != ntohs(packet->len)) {
-                    return;  // TODO what else ?
-                }
-                current_node->last_retransmit = now_ms;
-            }
-            current_node = current_node->next;
-        }
-
-        // before rel_destoy: EOF send, EOF received, send_buffer empty, output_buffer empty
-        if (buffer_size(current->send_buffer) == 0 && buffer_size(current->recv_buffer) == 0 && current->send_EOF && current->recv_EOF) {
+    // Go over the timers that are due (one clock read for all of them): retransmit
+    // packets whose timer has expired and destroy finished connections
+    long now_ms = getCurrentTime();
+    timer_entry_t *timer;
+    while ((timer = timer_pop_expired(&timers, now_ms)) != NULL) {
+        rel_t *current = timer->arg;
+        if (timer == &current->close_timer) {
             rel_destroy(current);
             fprintf(stderr, "info: connection destroyed\n");
-            return;
+            continue;
+        }
+        if (timer == &current->ack_timer) {
+            send_ack(current);
+            continue;
+        }
+        if (timer == &current->persist_timer) {
+            persist_on_timeout(current, now_ms);
+            continue;
+        }
+        if (timer == &current->probe_timer) {
+            pmtu_on_timeout(current);
+            continue;
+        }
+        if (timer == &current->cork_timer) {
+            current->cork_expired = 1;
+            rel_read(current);
+            continue;
+        }
+        if (timer == &current->hello_timer) {
+            send_hello_request(current);
+            continue;
+        }
+
+        // back off once per timeout, i.e. for the oldest outstanding packet, not for every packet due with it
+        buffer_node_t *current_node = (buffer_node_t *)((char *)timer - offsetof(buffer_node_t, timer));
+        if (current->recv_EOF && buffer_size(current->recv_buffer) == 0 && current_node->retransmits >= CLOSE_RETRIES) {
+            fprintf(stderr, "error: no ack from peer after EOF, giving up\n");
+            conn_flush(current->c);
+            current->window_size -= buffer_remove(current->send_buffer, current->current_seq_no);
+            check_done(current);
+            continue;
+        }
+        if (current_node == buffer_get_first(current->send_buffer)) {
+            current->rto = 2 * current->rto < RTO_MAX ? 2 * current->rto : RTO_MAX;
+            congestion_on_timeout(&current->congestion, current->window_size, current->current_seq_no - 1, now_ms);
+        }
+
+        // retransmit packet (re-arms the timer)
+        current_node->retransmits++;
+        current->timeout_retransmits++;
+        if (current->pmtud && current_node->retransmits == PMTU_BLACKHOLE
+            && ntohs(current_node->packet->len) > REL_PKT_SIZE(REL_MSS_DEFAULT)) {
+            pmtu_blackhole(current);
         }
-        current = rel_list->next;
+        send_buffered(current, current_node, now_ms);
     }
 
     return;
 }
+
+long rel_timeout() {
+    timer_entry_t *first = timer_first(&timers);
+    if (first == NULL) {
+        return -1;
+    }
+    long to = first->deadline - getCurrentTime();
+    return to > 0 ? to : 0;
+}
@@ -1,5 +1,7 @@
 /* rlib version 5 */
 
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -11,19 +13,62 @@
 #include <getopt.h>
 #include <assert.h>
 #include <stddef.h>
+#include <limits.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <poll.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef __linux__
+#define HAVE_EPOLL 1
+#define HAVE_MMSG 1
+#include <sys/epoll.h>
+#endif /* __linux__ */
+
+#if HAVE_MMSG && defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define HAVE_UDP_OFFLOAD 1
+#endif /* HAVE_MMSG && UDP_SEGMENT && UDP_GRO */
 
 #include "rlib.h"
+#include "congestion.h"
+#include "pool.h"
 
 char *progname;
 int opt_debug;
+int opt_stats;
 int log_in = -1;
 int log_out = -1;
 
+/* Datagrams moved per recvmmsg/sendmmsg call (1 disables batching) */
+#define CONN_BATCH_DEFAULT 16
+static int opt_batch = CONN_BATCH_DEFAULT;
+static int opt_poll;        /* use poll() rather than epoll */
+static int opt_threads = 1; /* server event loops */
+static int opt_pmtud;       /* send datagrams with DF set (--pmtud) */
+
+/* UDP offload, where the kernel has it (and datagrams are batched): a
+ * run of queued packets of one size goes out as a single GSO send the
+ * kernel segments (UDP_SEGMENT), and the kernel may hand us a run of
+ * packets of one size as a single coalesced datagram (UDP_GRO).  Both
+ * are detected when the socket is set up; --offload off disables them */
+static int opt_offload = 1;
+static int udp_gso;         /* UDP_SEGMENT works on our sockets */
+static int udp_gro;         /* UDP_GRO is on for our sockets */
+#define CONN_GSO_SEGMENTS 64 /* UDP_MAX_SEGMENTS of older kernels */
+#define CONN_GSO_BYTES REL_PKT_SIZE(REL_MSS_MAX) /* largest datagram */
+#define CONN_GRO_BUFSIZE 65536
+
+/* Output buffering per connection (conn_bufspace): by default a window
+ * of full packets, so that a receiver can release a whole window at
+ * once, but at least CONN_OUTBUF_MIN bytes */
+#define CONN_OUTBUF_MIN 8192
+static size_t opt_outbuf;
+
 struct config_server
 {
     struct config_common c;
@@ -33,17 +78,69 @@ struct config_server
     address */
 };
 
-static struct config_server *serverconf;
+/* With --threads, the server runs an event loop per thread, each with
+ * its own UDP socket bound to the same port with SO_REUSEPORT.  The kernel
+ * hashes every peer to one of the sockets, so a connection lives on one
+ * thread for good, and all the state of an event loop (connections, poll
+ * sets, batches, and the timers and rel_list of reliable.c) is
+ * thread-local: nothing is shared or locked on the hot path. */
+struct server_thread
+{
+    struct config_server sc;
+    int cpu; /* CPU to pin the thread to, -1 for none */
+    pthread_t thread;
+};
+
+static __thread struct config_server *serverconf;
+
+/* Server connections by peer address, so that demultiplexing a datagram
+ * costs O(1) however many peers there are.  Open addressing with linear
+ * probing, kept at most half full. */
+static __thread conn_t **conn_table;
+static __thread unsigned int conn_table_bits; /* 1 << conn_table_bits slots */
+static __thread unsigned int conn_table_used;
+
+/* Server connections pool only their windows plus this many staging
+ * objects, since thousands of them may be open at once */
+#define CONN_POOL_SLACK_SERVER 8
+
+/* Receive buffer of the server's UDP socket */
+#define SERVER_RCVBUF (4 << 20)
+
+/* Datagrams received by the server before their connection is known */
+static __thread char *server_pkts; /* opt_batch packets of server_pktsize */
+static __thread size_t server_pktsize;
+static __thread struct sockaddr_storage *server_from;
 
 static void conn_mkevents(void);
 static int debug_recv(int s, packet_t *buf, size_t len, int flags,
                       struct sockaddr_storage *from);
 
-int cevents_generation;
-static struct pollfd *cevents;
-static int ncevents;
-static conn_t **evreaders;
-static conn_t **evwriters;
+__thread int cevents_generation;
+static __thread struct pollfd *cevents;
+static __thread int ncevents;
+static __thread conn_t **evreaders;
+static __thread conn_t **evwriters;
+
+/* With the epoll backend, every polled descriptor is an event source
+ * registered once (in conn_alloc) and unregistered in conn_free; only
+ * changes of interest (xoff, pending output) touch the kernel. */
+struct evsource
+{
+    conn_t *c;    /* owning connection, NULL for stderr and the server */
+    int fd;
+    int events;   /* current interest (EPOLLIN/EPOLLOUT) */
+    char added;   /* registered with the epoll instance */
+    char always;  /* not pollable (e.g., a regular file), always ready */
+    struct evsource *next; /* list of always-ready sources */
+};
+
+#if HAVE_EPOLL
+static __thread int epfd = -1;  /* epoll instance, -1 when using poll() */
+static __thread struct evsource stderr_src;
+static __thread struct evsource server_src; /* the server's UDP socket */
+static __thread struct evsource *always_ready;
+#endif /* HAVE_EPOLL */
 
 struct chunk
 {
@@ -54,6 +151,12 @@ struct chunk
 };
 typedef struct chunk chunk_t;
 
+/* Connection pool objects hold either a packet or an output chunk of up to
+ * one packet's worth of data: of REL_MSS_DEFAULT, plus a class of the
+ * connection's MSS if that is larger */
+#define CONN_POOL_OBJSIZE offsetof(chunk_t, buf[REL_PKT_SIZE(REL_MSS_DEFAULT)])
+#define CONN_POOL_SLACK 32
+
 struct conn
 {
     rel_t *rel; /* Data from reliable */
@@ -62,11 +165,17 @@ struct conn
     int wpoll;
     int npoll;
 
+    struct evsource src[3]; /* epoll sources for rfd, wfd and nfd */
+    struct evsource *rsrc;  /* NULL if not registered */
+    struct evsource *wsrc;  /* == rsrc if wfd == rfd */
+    struct evsource *nsrc;
+
     int rfd;                      /* input file descriptor */
     int wfd;                      /* output file descriptor */
     int nfd;                      /* network file descriptor */
     char server;                  /* non-zero on server */
     struct sockaddr_storage peer; /* network peer */
+    unsigned int hash;            /* addrhash(&peer), on server */
 
     char read_eof;  /* zero if haven't received EOF */
     char write_eof; /* send EOF when output queue drained */
@@ -75,13 +184,67 @@ struct conn
     char delete_me; /* delete after draining */
     chunk_t *outq;  /* chunks not yet written */
     chunk_t **outqtail;
+    size_t outq_bytes; /* bytes in outq not yet written */
+    size_t pktsize;    /* largest packet taken, REL_PKT_SIZE(mss) */
+    pool_t *pool;   /* packets and output chunks of this connection */
+
+#if HAVE_MMSG
+    /* Packets queued by conn_sendpkt, sent by conn_flush */
+    struct mmsghdr *sendq;
+    struct iovec *sendq_iov;
+    char (*sendq_small)[CONN_SMALL_PKT]; /* copies of short (ack/EOF) packets */
+    int sendq_len;
+    int sendq_max;     /* opt_batch, or enough to fill a GSO send */
+    char sendq_nogso;  /* GSO failed on this connection's route */
+    struct conn *sendq_next; /* list of connections with queued packets */
+    char sendq_pending;
+#endif /* HAVE_MMSG */
+
+    struct
+    {
+        uint64_t input_bytes;  /* read by conn_input(v) */
+        uint64_t input_bufs;   /* buffers (partly) filled by conn_input(v) */
+        uint64_t read_calls;   /* read/readv system calls for input */
+        uint64_t output_bytes; /* accepted by conn_output */
+        uint64_t copy_bytes;   /* copied in user space (output queue) */
+        uint64_t output_bufs;  /* buffers accepted by conn_output(v) */
+        uint64_t write_calls;  /* write/writev system calls for output */
+        uint64_t send_calls;   /* send/sendto/sendmmsg system calls */
+        uint64_t send_pkts;
+        uint64_t recv_calls;   /* recv/recvmmsg system calls */
+        uint64_t recv_pkts;
+        uint64_t gso_sends;    /* datagrams the kernel segmented */
+        uint64_t gso_pkts;     /* packets in them */
+        uint64_t gro_recvs;    /* datagrams the kernel coalesced */
+        uint64_t gro_pkts;     /* packets in them */
+    } stats;
 
     struct conn *next; /* Linked list of connections */
     struct conn **prev;
 };
 
-static conn_t *conn_list;
-struct timespec last_timeout;
+static __thread conn_t *conn_list;
+
+#if HAVE_MMSG
+static __thread conn_t *sendq_list; /* connections with queued packets */
+
+/* Scratch space for batched receives */
+static __thread struct mmsghdr *recvq;
+static __thread struct iovec *recvq_iov;
+static __thread packet_t **recvq_pkts;
+
+/* Scratch space for GSO sends and GRO receives */
+union conn_cmsg
+{
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+};
+static __thread struct mmsghdr *gsoq;
+static __thread int *gsoq_segs;  /* packets in each message of gsoq */
+static __thread union conn_cmsg *gsoq_cmsg;
+static __thread union conn_cmsg *recvq_cmsg;
+static __thread char *gro_bufs;  /* opt_batch of CONN_GRO_BUFSIZE */
+#endif /* HAVE_MMSG */
 
 #if !DMALLOC
 void *
@@ -143,15 +306,274 @@ void print_pkt(const packet_t *buf, const char *op, int n)
     errno = saved_errno;
 }
 
+#if HAVE_EPOLL
+static void
+evsource_add(struct evsource *src, conn_t *c, int fd, int events)
+{
+    struct epoll_event ev;
+
+    src->c = c;
+    src->fd = fd;
+    src->events = events;
+    src->added = 0;
+    src->always = 0;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+        src->added = 1;
+    else if (errno == EPERM)
+    {
+        /* poll() reports regular files as always ready, so do we */
+        src->always = 1;
+        src->next = always_ready;
+        always_ready = src;
+    }
+    else
+        perror("epoll_ctl");
+}
+
+static void
+evsource_set(struct evsource *src, int events)
+{
+    struct epoll_event ev;
+
+    if (events == src->events)
+        return;
+    src->events = events;
+    if (!src->added)
+        return;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, src->fd, &ev) < 0)
+        perror("epoll_ctl");
+}
+
+static void
+evsource_del(struct evsource *src)
+{
+    struct evsource **sp;
+
+    if (src->added)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, src->fd, NULL);
+    if (src->always)
+        for (sp = &always_ready; *sp; sp = &(*sp)->next)
+            if (*sp == src)
+            {
+                *sp = src->next;
+                break;
+            }
+    src->added = 0;
+    src->always = 0;
+    src->events = 0;
+}
+#endif /* HAVE_EPOLL */
+
+/* Turn interest in input becoming readable on or off */
+static void
+conn_wantread(conn_t *c, int on)
+{
+#if HAVE_EPOLL
+    if (epfd >= 0)
+    {
+        if (c->rsrc)
+            evsource_set(c->rsrc, on ? c->rsrc->events | EPOLLIN
+                                     : c->rsrc->events & ~EPOLLIN);
+        return;
+    }
+#endif /* HAVE_EPOLL */
+    if (!c->rpoll)
+        return;
+    if (on)
+        cevents[c->rpoll].events |= POLLIN;
+    else
+        cevents[c->rpoll].events &= ~POLLIN;
+}
+
+/* Turn interest in output becoming writable on or off */
+static void
+conn_wantwrite(conn_t *c, int on)
+{
+#if HAVE_EPOLL
+    if (epfd >= 0)
+    {
+        if (c->wsrc)
+            evsource_set(c->wsrc, on ? c->wsrc->events | EPOLLOUT
+                                     : c->wsrc->events & ~EPOLLOUT);
+        return;
+    }
+#endif /* HAVE_EPOLL */
+    if (!c->wpoll)
+        return;
+    if (on)
+        cevents[c->wpoll].events |= POLLOUT;
+    else
+        cevents[c->wpoll].events &= ~POLLOUT;
+}
+
+#if HAVE_MMSG
+/* Gather the packets queued on c from first on into the messages of
+ * gsoq: with GSO, each run of packets of one size (and a shorter last
+ * one) becomes a single message the kernel segments, otherwise each
+ * packet is a message of its own.  Returns the number of messages. */
+static int
+conn_gso_batch(conn_t *c, int first)
+{
+    int gso = udp_gso && !c->sendq_nogso;
+    int m, i, j;
+
+    for (m = 0, i = first; i < c->sendq_len; m++, i = j)
+    {
+        struct msghdr *mh = &gsoq[m].msg_hdr;
+        size_t seg = c->sendq_iov[i].iov_len;
+        size_t total = seg;
+
+        for (j = i + 1; gso && j < c->sendq_len && j - i < CONN_GSO_SEGMENTS
+                        && c->sendq_iov[j - 1].iov_len == seg
+                        && c->sendq_iov[j].iov_len <= seg
+                        && total + c->sendq_iov[j].iov_len <= CONN_GSO_BYTES;
+             j++)
+            total += c->sendq_iov[j].iov_len;
+
+        /* The iovecs of the packets are consecutive */
+        *mh = c->sendq[i].msg_hdr;
+        mh->msg_iovlen = j - i;
+        gsoq_segs[m] = j - i;
+#if HAVE_UDP_OFFLOAD
+        if (j - i > 1)
+        {
+            struct cmsghdr *cm;
+            uint16_t segsize = seg;
+
+            mh->msg_control = gsoq_cmsg[m].buf;
+            mh->msg_controllen = CMSG_SPACE(sizeof(segsize));
+            cm = CMSG_FIRSTHDR(mh);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(segsize));
+            memcpy(CMSG_DATA(cm), &segsize, sizeof(segsize));
+        }
+#endif /* HAVE_UDP_OFFLOAD */
+    }
+    return m;
+}
+#endif /* HAVE_MMSG */
+
+/* Send all packets queued on c with as few sendmmsg calls (and, with
+ * GSO, as few datagrams down the stack) as possible */
+void
+conn_flush(conn_t *c)
+{
+#if HAVE_MMSG
+    int i, k, m, n, sent = 0;
+
+    while (sent < c->sendq_len)
+    {
+        m = conn_gso_batch(c, sent);
+        n = sendmmsg(c->nfd, gsoq, m, 0);
+        c->stats.send_calls++;
+        if (n <= 0)
+        {
+            /* Some routes cannot segment (e.g., no checksum offload on the
+             * device): send the packets one by one from now on */
+            if (gsoq_segs[0] > 1 && (errno == EIO || errno == EINVAL))
+            {
+                c->sendq_nogso = 1;
+                continue;
+            }
+            /* Treat what could not be sent like lost packets */
+            if (opt_debug)
+                print_pkt(c->sendq_iov[sent].iov_base, "send", -1);
+            else if (errno != EAGAIN && errno != ECONNREFUSED
+                     && errno != EMSGSIZE)
+                perror("sendmmsg");
+            sent += gsoq_segs[0];
+            continue;
+        }
+        for (k = 0; k < n; k++)
+        {
+            if (opt_debug)
+                for (i = sent; i < sent + gsoq_segs[k]; i++)
+                    print_pkt(c->sendq_iov[i].iov_base, "send",
+                              c->sendq_iov[i].iov_len);
+            c->stats.send_pkts += gsoq_segs[k];
+            if (gsoq_segs[k] > 1)
+            {
+                c->stats.gso_sends++;
+                c->stats.gso_pkts += gsoq_segs[k];
+            }
+            sent += gsoq_segs[k];
+        }
+    }
+    c->sendq_len = 0;
+#endif /* HAVE_MMSG */
+}
+
+/* Flush the send queues of all connections */
+static void
+conn_flushall(void)
+{
+#if HAVE_MMSG
+    conn_t *c;
+
+    while ((c = sendq_list))
+    {
+        sendq_list = c->sendq_next;
+        c->sendq_pending = 0;
+        conn_flush(c);
+    }
+#endif /* HAVE_MMSG */
+}
+
 int conn_sendpkt(conn_t *c, const packet_t *pkt, size_t len)
 {
     int n;
     assert(!c->delete_me);
+#if HAVE_MMSG
+    if (c->sendq)
+    {
+        struct msghdr *mh = &c->sendq[c->sendq_len].msg_hdr;
+        struct iovec *iov = &c->sendq_iov[c->sendq_len];
+
+        /* Short packets may live on the caller's stack, so copy them; longer
+         * ones must stay valid until the queue is flushed */
+        if (len <= sizeof(c->sendq_small[0]))
+        {
+            memcpy(c->sendq_small[c->sendq_len], pkt, len);
+            iov->iov_base = c->sendq_small[c->sendq_len];
+        }
+        else
+            iov->iov_base = (void *)pkt;
+        iov->iov_len = len;
+        memset(mh, 0, sizeof(*mh));
+        mh->msg_iov = iov;
+        mh->msg_iovlen = 1;
+        if (c->server)
+        {
+            mh->msg_name = &c->peer;
+            mh->msg_namelen = addrsize(&c->peer);
+        }
+        if (++c->sendq_len == c->sendq_max)
+            conn_flush(c);
+        else if (!c->sendq_pending)
+        {
+            c->sendq_pending = 1;
+            c->sendq_next = sendq_list;
+            sendq_list = c;
+        }
+        return len;
+    }
+#endif /* HAVE_MMSG */
     if (c->server)
         n = sendto(c->nfd, pkt, len, 0,
                    (const struct sockaddr *)&c->peer, addrsize(&c->peer));
     else
         n = send(c->nfd, pkt, len, 0);
+    c->stats.send_calls++;
+    if (n >= 0)
+        c->stats.send_pkts++;
     if (opt_debug)
         print_pkt(pkt, "send", n);
     return n;
@@ -160,19 +582,12 @@ int conn_sendpkt(conn_t *c, const packet_t *pkt, size_t len)
 size_t
 conn_bufspace(conn_t *c)
 {
-    chunk_t *ch;
-    size_t used = 0;
-    const size_t bufsize = 8192;
-
-    for (ch = c->outq; ch; ch = ch->next)
-        used += (ch->size - ch->used);
-    return used > bufsize ? 0 : bufsize - used;
+    return c->outq_bytes > opt_outbuf ? 0 : opt_outbuf - c->outq_bytes;
 }
 
-int conn_output(conn_t *c, const void *_buf, size_t _n)
+int conn_output(conn_t *c, const void *buf, size_t n)
 {
-    const char *buf = _buf;
-    int n = _n;
+    struct iovec iov;
 
     assert(!c->delete_me && !c->write_eof);
 
@@ -184,6 +599,18 @@ int conn_output(conn_t *c, const void *_buf, size_t _n)
         return 0;
     }
 
+    iov.iov_base = (void *)buf;
+    iov.iov_len = n;
+    return conn_outputv(c, &iov, 1);
+}
+
+int conn_outputv(conn_t *c, const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0, off;
+    int i;
+
+    assert(!c->delete_me && !c->write_eof);
+
     if (c->write_err)
     {
         if (c->write_err == 2)
@@ -195,52 +622,83 @@ int conn_output(conn_t *c, const void *_buf, size_t _n)
     if (!conn_bufspace(c))
         return 0;
 
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
     if (log_out >= 0)
-        write(log_out, buf, n);
+        for (i = 0; i < iovcnt; i++)
+            write(log_out, iov[i].iov_base, iov[i].iov_len);
 
-    if (!c->outq)
+    /* Write directly as long as the kernel takes everything, IOV_MAX
+     * buffers at a time; iov[i] + off is the first byte not written */
+    for (i = 0, off = 0; !c->outq && i < iovcnt;)
     {
-        int r = write(c->wfd, buf, n);
+        int first = i;
+        int cnt = iovcnt - i < IOV_MAX ? iovcnt - i : IOV_MAX;
+        ssize_t r = writev(c->wfd, iov + i, cnt);
+        c->stats.write_calls++;
         if (r < 0)
         {
             if (errno != EAGAIN)
             {
-                perror("write");
+                perror("writev");
                 c->write_err = 2;
                 return -1;
             }
+            break;
         }
-        else
-        {
-            buf += r;
-            n -= r;
-        }
+        while (i < first + cnt && (size_t)r >= iov[i].iov_len)
+            r -= iov[i++].iov_len;
+        off = r;
+        if (i < first + cnt)
+            break;
     }
 
-    if (n > 0)
+    /* Queue whatever the kernel did not take, a chunk per buffer */
+    for (; i < iovcnt; i++, off = 0)
     {
-        chunk_t *ch = xmalloc(offsetof(chunk_t, buf[n]));
+        size_t n = iov[i].iov_len - off;
+        chunk_t *ch;
+
+        if (n == 0)
+            continue;
+        ch = pool_get_size(c->pool, offsetof(chunk_t, buf[n]));
         ch->next = NULL;
         ch->size = n;
         ch->used = 0;
-        memcpy(ch->buf, buf, n);
+        memcpy(ch->buf, (const char *)iov[i].iov_base + off, n);
+        c->stats.copy_bytes += n;
+        c->outq_bytes += n;
         *c->outqtail = ch;
         c->outqtail = &ch->next;
     }
 
-    if (c->wpoll && c->outq)
-        cevents[c->wpoll].events |= POLLOUT;
-    return _n;
+    c->stats.output_bytes += total;
+    c->stats.output_bufs += iovcnt;
+    if (c->outq)
+        conn_wantwrite(c, 1);
+    return total;
 }
 
 int conn_input(conn_t *c, void *buf, size_t n)
 {
-    int r;
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = n;
+    return conn_inputv(c, &iov, 1);
+}
+
+int conn_inputv(conn_t *c, const struct iovec *iov, int iovcnt)
+{
+    int r, i;
+    size_t left;
     assert(!c->delete_me);
 
     if (c->read_eof)
         return -1;
-    r = read(c->rfd, buf, n);
+    r = readv(c->rfd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+    c->stats.read_calls++;
     if (r == 0 || (r < 0 && errno != EAGAIN))
     {
         if (r == 0)
@@ -252,26 +710,158 @@ int conn_input(conn_t *c, void *buf, size_t n)
     if (r < 0 && errno == EAGAIN)
         r = 0;
 
-    if (r > 0 && log_in >= 0)
-        write(log_in, buf, r);
+    for (i = 0, left = r; left > 0; left -= iov[i++].iov_len)
+    {
+        if (log_in >= 0)
+            write(log_in, iov[i].iov_base,
+                  left < iov[i].iov_len ? left : iov[i].iov_len);
+        c->stats.input_bufs++;
+        if (left < iov[i].iov_len)
+            break;
+    }
+    c->stats.input_bytes += r;
 
     c->xoff = 0;
-    cevents[c->rpoll].events |= POLLIN;
+    conn_wantread(c, 1);
     return r;
 }
 
+/* Home slot of a hash: multiplicative hashing spreads addresses that
+ * differ only in their low bits (e.g., consecutive ports) over the table */
+static unsigned int
+conn_table_home(unsigned int hash)
+{
+    return (hash * 2654435761u) >> (32 - conn_table_bits);
+}
+
 static conn_t *
-conn_alloc(void)
+conn_table_find(const struct sockaddr_storage *ss, unsigned int hash)
+{
+    unsigned int mask, i;
+    conn_t *c;
+
+    if (!conn_table)
+        return NULL;
+    mask = (1u << conn_table_bits) - 1;
+    for (i = conn_table_home(hash); (c = conn_table[i]); i = (i + 1) & mask)
+        if (c->hash == hash && addreq(&c->peer, ss))
+            return c;
+    return NULL;
+}
+
+/* Put c into the first free slot at or after its home slot */
+static void
+conn_table_place(conn_t *c)
+{
+    unsigned int mask = (1u << conn_table_bits) - 1;
+    unsigned int i;
+
+    for (i = conn_table_home(c->hash); conn_table[i]; i = (i + 1) & mask)
+        ;
+    conn_table[i] = c;
+}
+
+static void
+conn_table_insert(conn_t *c)
+{
+    if (2 * (conn_table_used + 1) > (1u << conn_table_bits))
+    {
+        conn_t **old = conn_table;
+        unsigned int i, n = conn_table ? 1u << conn_table_bits : 0;
+
+        conn_table_bits = conn_table ? conn_table_bits + 1 : 6;
+        conn_table = xmalloc(sizeof(*conn_table) << conn_table_bits);
+        memset(conn_table, 0, sizeof(*conn_table) << conn_table_bits);
+        for (i = 0; i < n; i++)
+            if (old[i])
+                conn_table_place(old[i]);
+        free(old);
+    }
+    conn_table_place(c);
+    conn_table_used++;
+}
+
+static void
+conn_table_remove(conn_t *c)
+{
+    unsigned int mask = (1u << conn_table_bits) - 1;
+    unsigned int i;
+    conn_t *d;
+
+    for (i = conn_table_home(c->hash); conn_table[i] != c; i = (i + 1) & mask)
+        assert(conn_table[i]);
+    conn_table[i] = NULL;
+    conn_table_used--;
+
+    /* Without tombstones, the rest of the probe run must be placed again
+     * so that lookups do not stop at the hole */
+    for (i = (i + 1) & mask; (d = conn_table[i]); i = (i + 1) & mask)
+    {
+        conn_table[i] = NULL;
+        conn_table_place(d);
+    }
+}
+
+static conn_t *
+conn_alloc(const struct config_common *cc, int rfd, int wfd, int nfd,
+           int server)
 {
     conn_t *c = xmalloc(sizeof(*c));
     memset(c, 0, sizeof(*c));
     c->prev = &conn_list;
     c->next = conn_list;
     c->outqtail = &c->outq;
+    c->rfd = rfd;
+    c->wfd = wfd;
+    c->nfd = nfd;
+    c->server = server;
+    /* Sender and receiver windows, a receive batch plus a few staging
+     * packets and output chunks, so that a steady-state transfer never
+     * touches the heap.  Server connections do not receive in batches. */
+    c->pool = pool_create(CONN_POOL_OBJSIZE,
+                          2 * cc->window + (server ? CONN_POOL_SLACK_SERVER
+                                                   : opt_batch + CONN_POOL_SLACK));
+    /* With a larger MSS, full packets come from a class of their own,
+     * while acks and short packets keep to the small one */
+    c->pktsize = REL_PKT_SIZE(cc->mss);
+    if (cc->mss > REL_MSS_DEFAULT)
+        pool_add_class(c->pool, offsetof(chunk_t, buf[c->pktsize]),
+                       2 * cc->window + (server ? CONN_POOL_SLACK_SERVER
+                                                : opt_batch));
+#if HAVE_MMSG
+    if (opt_batch > 1)
+    {
+        c->sendq_max = udp_gso && opt_batch < CONN_GSO_SEGMENTS
+                       ? CONN_GSO_SEGMENTS : opt_batch;
+        c->sendq = xmalloc(c->sendq_max * sizeof(*c->sendq));
+        c->sendq_iov = xmalloc(c->sendq_max * sizeof(*c->sendq_iov));
+        c->sendq_small = xmalloc(c->sendq_max * sizeof(*c->sendq_small));
+    }
+#endif /* HAVE_MMSG */
     if (conn_list)
         conn_list->prev = &c->next;
     conn_list = c;
 
+#if HAVE_EPOLL
+    if (epfd >= 0)
+    {
+        c->rsrc = &c->src[0];
+        evsource_add(c->rsrc, c, rfd, EPOLLIN);
+        if (wfd == rfd)
+            c->wsrc = c->rsrc;
+        else
+        {
+            c->wsrc = &c->src[1];
+            evsource_add(c->wsrc, c, wfd, 0);
+        }
+        /* Server connections share the UDP socket */
+        if (!server)
+        {
+            c->nsrc = &c->src[2];
+            evsource_add(c->nsrc, c, nfd, EPOLLIN);
+        }
+    }
+#endif /* HAVE_EPOLL */
     cevents_generation++;
 
     return c;
@@ -302,30 +892,131 @@ conn_create(rel_t *rel, const struct sockaddr_storage *ss)
         return NULL;
     }
 
-    c = conn_alloc();
+    c = conn_alloc(&serverconf->c, n, n, serverconf->udp_socket, 1);
     c->peer = *ss;
+    c->hash = addrhash(ss);
     c->rel = rel;
-    c->nfd = serverconf->udp_socket;
-    c->rfd = c->wfd = n;
-    c->server = 1;
+    conn_table_insert(c);
 
     return c;
 }
 
+pool_t *
+conn_pool(conn_t *c)
+{
+    return c->pool;
+}
+
+size_t
+conn_mtu(conn_t *c)
+{
+    int mtu = 0;
+    socklen_t len = sizeof(mtu);
+
+#if defined(IP_MTU) && defined(IPV6_MTU)
+    /* Only a connected socket has a path, so the server's has none */
+    if (c->server || !opt_pmtud)
+        return 0;
+    if (c->peer.ss_family == AF_INET6)
+    {
+        if (getsockopt(c->nfd, IPPROTO_IPV6, IPV6_MTU, &mtu, &len) == 0
+            && mtu > 40 + 8)
+            return mtu - (40 + 8);
+    }
+    else if (getsockopt(c->nfd, IPPROTO_IP, IP_MTU, &mtu, &len) == 0
+             && mtu > 20 + 8)
+        return mtu - (20 + 8);
+#endif /* IP_MTU && IPV6_MTU */
+    return 0;
+}
+
+static void
+conn_print_stats(conn_t *c)
+{
+    uint64_t payload = c->stats.input_bytes + c->stats.output_bytes;
+    uint64_t calls = c->stats.send_calls + c->stats.recv_calls;
+    uint64_t pkts = c->stats.send_pkts + c->stats.recv_pkts;
+    int i;
+
+    /* Every payload byte is copied once by the read() or write() moving it
+     * between the kernel and a packet; anything beyond that is overhead */
+    fprintf(stderr, "[stats] bytes: %llu in, %llu out, %llu copied"
+                    " (%.2f copies per payload byte)\n",
+            (unsigned long long)c->stats.input_bytes,
+            (unsigned long long)c->stats.output_bytes,
+            (unsigned long long)c->stats.copy_bytes,
+            payload ? (double)(payload + c->stats.copy_bytes) / payload : 0.0);
+    fprintf(stderr, "[stats] syscalls: %llu sends for %llu packets,"
+                    " %llu receives for %llu packets"
+                    " (%.2f syscalls per packet)\n",
+            (unsigned long long)c->stats.send_calls,
+            (unsigned long long)c->stats.send_pkts,
+            (unsigned long long)c->stats.recv_calls,
+            (unsigned long long)c->stats.recv_pkts,
+            pkts ? (double)calls / pkts : 0.0);
+    if (udp_gso || udp_gro)
+        fprintf(stderr, "[stats] offload: %llu GSO sends of %llu packets,"
+                        " %llu GRO receives of %llu packets\n",
+                (unsigned long long)c->stats.gso_sends,
+                (unsigned long long)c->stats.gso_pkts,
+                (unsigned long long)c->stats.gro_recvs,
+                (unsigned long long)c->stats.gro_pkts);
+    fprintf(stderr, "[stats] input: %llu reads for %llu buffers"
+                    " (%.2f buffers per read)\n",
+            (unsigned long long)c->stats.read_calls,
+            (unsigned long long)c->stats.input_bufs,
+            c->stats.read_calls ? (double)c->stats.input_bufs / c->stats.read_calls : 0.0);
+    fprintf(stderr, "[stats] output: %llu writes for %llu buffers"
+                    " (%.2f buffers per write)\n",
+            (unsigned long long)c->stats.write_calls,
+            (unsigned long long)c->stats.output_bufs,
+            c->stats.write_calls ? (double)c->stats.output_bufs / c->stats.write_calls : 0.0);
+    fprintf(stderr, "[stats] pool: %llu hits, %llu misses (",
+            (unsigned long long)c->pool->hits,
+            (unsigned long long)c->pool->misses);
+    for (i = 0; i < c->pool->nclasses; i++)
+        fprintf(stderr, "%s%u slots of %d bytes", i ? ", " : "",
+                c->pool->classes[i].capacity,
+                (int)c->pool->classes[i].object_size);
+    fprintf(stderr, ")\n");
+}
+
 static void
 conn_free(conn_t *c)
 {
     chunk_t *ch, *nch;
 
+#if HAVE_MMSG
+    if (c->sendq_pending)
+        conn_flushall();
+    free(c->sendq);
+    free(c->sendq_iov);
+    free(c->sendq_small);
+#endif /* HAVE_MMSG */
+    if (opt_stats)
+        conn_print_stats(c);
+
     for (ch = c->outq; ch; ch = nch)
     {
         nch = ch->next;
-        free(ch);
+        pool_put(c->pool, ch);
     }
+    pool_destroy(c->pool);
 
     if (c->next)
         c->next->prev = c->prev;
     *c->prev = c->next;
+    if (c->server)
+        conn_table_remove(c);
+
+#if HAVE_EPOLL
+    if (c->rsrc)
+        evsource_del(c->rsrc);
+    if (c->wsrc && c->wsrc != c->rsrc)
+        evsource_del(c->wsrc);
+    if (c->nsrc)
+        evsource_del(c->nsrc);
+#endif /* HAVE_EPOLL */
 
     close(c->rfd);
     if (c->wfd != c->rfd)
@@ -342,6 +1033,8 @@ conn_free(conn_t *c)
 
 void conn_destroy(conn_t *c)
 {
+    /* The caller frees the packets it queued right after */
+    conn_flush(c);
     c->delete_me = 1;
 }
 
@@ -350,34 +1043,50 @@ void conn_drain(conn_t *c)
     chunk_t *ch;
     int didsome = 0;
 
-    if (c->wpoll)
-        cevents[c->wpoll].events &= ~POLLOUT;
+    conn_wantwrite(c, 0);
 
     if (c->write_err)
         return;
 
-    while ((ch = c->outq))
+    /* Flush the queue with one writev per IOV_MAX chunks */
+    while (c->outq)
     {
-        int n = write(c->wfd, ch->buf + ch->used,
-                      ch->size - ch->used);
+        struct iovec iov[IOV_MAX];
+        int cnt = 0, i;
+        ssize_t n;
+
+        for (ch = c->outq; ch && cnt < IOV_MAX; ch = ch->next, cnt++)
+        {
+            iov[cnt].iov_base = ch->buf + ch->used;
+            iov[cnt].iov_len = ch->size - ch->used;
+        }
+        n = writev(c->wfd, iov, cnt);
+        c->stats.write_calls++;
         if (n < 0)
         {
             if (errno != EAGAIN)
                 c->write_err = 1;
+            else
+                conn_wantwrite(c, 1);
             break;
         }
         didsome = 1;
-        ch->used += n;
-        if (ch->used < ch->size)
+        c->outq_bytes -= n;
+        for (i = 0; i < cnt && (size_t)n >= iov[i].iov_len; i++)
         {
-            if (c->wpoll)
-                cevents[c->wpoll].events |= POLLOUT;
-            break;
+            n -= iov[i].iov_len;
+            ch = c->outq;
+            c->outq = ch->next;
+            pool_put(c->pool, ch);
         }
-        c->outq = ch->next;
         if (!c->outq)
             c->outqtail = &c->outq;
-        free(ch);
+        if (i < cnt)
+        {
+            c->outq->used += n;
+            conn_wantwrite(c, 1);
+            break;
+        }
     }
     if (c->write_eof && !c->write_err && !c->outq)
     {
@@ -474,26 +1183,407 @@ conn_mkevents(void)
     evwriters = w;
 }
 
-long need_timer_in(const struct timespec *last, long timer)
+/* Move a received packet of len bytes into an object of the smallest
+ * pool class that holds it, unless it already is in one: acks and short
+ * packets then do not tie up receive buffers of the largest packets */
+static packet_t *
+conn_shrink(conn_t *c, packet_t *pkt, int len)
 {
-    long to;
-    struct timespec ts;
+    packet_t *small;
+
+    if (pool_class_size(c->pool, len) >= pool_class_size(c->pool, c->pktsize))
+        return pkt;
+    small = pool_get_size(c->pool, len);
+    memcpy(small, pkt, len);
+    c->stats.copy_bytes += len;
+    pool_put(c->pool, pkt);
+    return small;
+}
 
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    to = ts.tv_sec - last->tv_sec;
-    if (to > timer / 1000)
-        return 0;
-    to = to * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
-    if (to >= timer)
-        return 0;
-    return timer - to;
+#if HAVE_UDP_OFFLOAD
+/* Receive a batch of datagrams from s into gro_bufs, naming their
+ * senders in server_from if from is non-zero.  Returns the number
+ * received, or -1 on error; each datagram may coalesce several packets
+ * (see gro_segsize). */
+static int
+gro_recv(int s, int from)
+{
+    int i;
+
+    for (i = 0; i < opt_batch; i++)
+    {
+        struct msghdr *mh = &recvq[i].msg_hdr;
+
+        recvq_iov[i].iov_base = gro_bufs + i * CONN_GRO_BUFSIZE;
+        recvq_iov[i].iov_len = CONN_GRO_BUFSIZE;
+        memset(mh, 0, sizeof(*mh));
+        mh->msg_iov = &recvq_iov[i];
+        mh->msg_iovlen = 1;
+        mh->msg_control = recvq_cmsg[i].buf;
+        mh->msg_controllen = sizeof(recvq_cmsg[i].buf);
+        if (from)
+        {
+            mh->msg_name = &server_from[i];
+            mh->msg_namelen = sizeof(server_from[i]);
+        }
+    }
+    return recvmmsg(s, recvq, opt_batch, 0, NULL);
 }
 
-void conn_poll(const struct config_common *cc)
+/* Size of the packets datagram i of the batch coalesces: all but the
+ * last one have it, which may be shorter (the length of the datagram if
+ * the kernel did not coalesce it) */
+static int
+gro_segsize(int i)
+{
+    struct msghdr *mh = &recvq[i].msg_hdr;
+    struct cmsghdr *cm;
+    int segsize;
+
+    for (cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm))
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+        {
+            memcpy(&segsize, CMSG_DATA(cm), sizeof(segsize));
+            if (segsize > 0 && segsize < (int)recvq[i].msg_len)
+                return segsize;
+        }
+    return recvq[i].msg_len;
+}
+
+/* Like conn_recv, but with UDP_GRO: each datagram is received into a
+ * pool packet, followed by the rest of its gro_bufs slot for the packets
+ * the kernel may have coalesced with it.  A datagram of a single packet,
+ * and the first packet of a coalesced one, are thus handed over as they
+ * are; the others are copied into pool packets of their own, which
+ * trades a copy for the receive calls (and trips through the stack)
+ * saved.  Datagrams of packets larger than we take are dropped. */
+static void
+conn_recv_gro(conn_t *c)
+{
+    int i, n, off, len, head, segsize;
+    packet_t *pkt;
+    char *buf;
+
+    for (i = 0; i < opt_batch; i++)
+    {
+        struct msghdr *mh = &recvq[i].msg_hdr;
+
+        recvq_pkts[i] = pool_get_size(c->pool, c->pktsize);
+        recvq_iov[2 * i].iov_base = recvq_pkts[i];
+        recvq_iov[2 * i].iov_len = c->pktsize;
+        recvq_iov[2 * i + 1].iov_base = gro_bufs + i * CONN_GRO_BUFSIZE
+                                        + c->pktsize;
+        recvq_iov[2 * i + 1].iov_len = CONN_GRO_BUFSIZE - c->pktsize;
+        memset(mh, 0, sizeof(*mh));
+        mh->msg_iov = &recvq_iov[2 * i];
+        mh->msg_iovlen = 2;
+        mh->msg_control = recvq_cmsg[i].buf;
+        mh->msg_controllen = sizeof(recvq_cmsg[i].buf);
+    }
+    n = recvmmsg(c->nfd, recvq, opt_batch, 0, NULL);
+    c->stats.recv_calls++;
+    if (n < 0)
+    {
+        if (opt_debug)
+            print_pkt(NULL, "recv", n);
+        else if (errno != EAGAIN)
+            perror("recvmmsg");
+        n = 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        buf = gro_bufs + i * CONN_GRO_BUFSIZE;
+        segsize = gro_segsize(i);
+        if (segsize > (int)c->pktsize)
+        {
+            pool_put(c->pool, recvq_pkts[i]);
+            continue;
+        }
+        if (segsize < (int)recvq[i].msg_len)
+        {
+            c->stats.gro_recvs++;
+            c->stats.gro_pkts += (recvq[i].msg_len + segsize - 1) / segsize;
+            /* The second packet starts in the pool packet: join it to
+             * the rest of the datagram before the first is handed over */
+            head = recvq[i].msg_len < c->pktsize ? (int)recvq[i].msg_len
+                                                 : (int)c->pktsize;
+            memcpy(buf + segsize, (char *)recvq_pkts[i] + segsize,
+                   head - segsize);
+            c->stats.copy_bytes += head - segsize;
+        }
+        for (off = 0; off < (int)recvq[i].msg_len; off += len)
+        {
+            len = recvq[i].msg_len - off < segsize ? recvq[i].msg_len - off
+                                                   : segsize;
+            if (off == 0)
+                pkt = conn_shrink(c, recvq_pkts[i], len);
+            else
+            {
+                pkt = pool_get_size(c->pool, len);
+                memcpy(pkt, buf + off, len);
+                c->stats.copy_bytes += len;
+            }
+            c->stats.recv_pkts++;
+            if (opt_debug)
+                print_pkt(pkt, "recv", len);
+            if (c->delete_me)
+                pool_put(c->pool, pkt);
+            else
+                rel_recvpkt(c->rel, pkt, len);
+        }
+    }
+    for (; i < opt_batch; i++)
+        pool_put(c->pool, recvq_pkts[i]);
+}
+#endif /* HAVE_UDP_OFFLOAD */
+
+/* Receive the pending packets of a client connection and hand them to
+ * rel_recvpkt.  Packets are received straight into pool packets, which
+ * rel_recvpkt then owns (and may keep without copying them). */
+static void
+conn_recv(conn_t *c)
+{
+#if HAVE_UDP_OFFLOAD
+    if (udp_gro)
+    {
+        conn_recv_gro(c);
+        return;
+    }
+#endif /* HAVE_UDP_OFFLOAD */
+#if HAVE_MMSG
+    if (opt_batch > 1)
+    {
+        int i, n;
+
+        for (i = 0; i < opt_batch; i++)
+        {
+            recvq_pkts[i] = pool_get_size(c->pool, c->pktsize);
+            recvq_iov[i].iov_base = recvq_pkts[i];
+            recvq_iov[i].iov_len = c->pktsize;
+            memset(&recvq[i].msg_hdr, 0, sizeof(recvq[i].msg_hdr));
+            recvq[i].msg_hdr.msg_iov = &recvq_iov[i];
+            recvq[i].msg_hdr.msg_iovlen = 1;
+        }
+        n = recvmmsg(c->nfd, recvq, opt_batch, 0, NULL);
+        c->stats.recv_calls++;
+        if (n < 0)
+        {
+            if (opt_debug)
+                print_pkt(NULL, "recv", n);
+            else if (errno != EAGAIN)
+                perror("recvmmsg");
+            n = 0;
+        }
+        for (i = 0; i < n; i++)
+        {
+            c->stats.recv_pkts++;
+            if (opt_debug)
+                print_pkt(recvq_pkts[i], "recv", recvq[i].msg_len);
+            if (c->delete_me)
+                pool_put(c->pool, recvq_pkts[i]);
+            else
+                rel_recvpkt(c->rel, conn_shrink(c, recvq_pkts[i], recvq[i].msg_len),
+                            recvq[i].msg_len);
+        }
+        for (; i < opt_batch; i++)
+            pool_put(c->pool, recvq_pkts[i]);
+        return;
+    }
+#endif /* HAVE_MMSG */
+
+    packet_t *pkt = pool_get_size(c->pool, c->pktsize);
+    int len = debug_recv(c->nfd, pkt, c->pktsize, 0, NULL);
+    c->stats.recv_calls++;
+    if (len < 0)
+    {
+        if (errno != EAGAIN)
+            perror("recv");
+        pool_put(c->pool, pkt);
+    }
+    else
+    {
+        c->stats.recv_pkts++;
+        rel_recvpkt(c->rel, conn_shrink(c, pkt, len), len);
+    }
+}
+
+/* Hand a datagram received by the server to the connection of its
+ * sender, creating one (and its TCP connection) on the first packet */
+static void
+server_deliver(const packet_t *buf, int len,
+               const struct sockaddr_storage *from)
+{
+    unsigned int hash = addrhash(from);
+    conn_t *c = conn_table_find(from, hash);
+    packet_t *pkt;
+
+    if (!c)
+    {
+        if (!rel_create(NULL, from, &serverconf->c))
+            return;
+        c = conn_table_find(from, hash);
+    }
+    /* Until it is freed, a destroyed connection swallows the packets of
+     * its peer */
+    if (c->delete_me)
+        return;
+
+    /* The datagram was received before its connection was known, so move
+     * it into a packet of that connection's pool */
+    pkt = pool_get_size(c->pool, len);
+    memcpy(pkt, buf, len);
+    c->stats.copy_bytes += len;
+    c->stats.recv_pkts++;
+    rel_recvpkt(c->rel, pkt, len);
+}
+
+/* Receive the pending datagrams of the server's UDP socket and
+ * demultiplex them to their connections */
+static void
+server_recv(void)
+{
+    int n;
+
+#if HAVE_UDP_OFFLOAD
+    if (udp_gro)
+    {
+        int i, off, len, segsize;
+
+        n = gro_recv(serverconf->udp_socket, 1);
+        if (n < 0)
+        {
+            if (opt_debug)
+                print_pkt(NULL, "recv", n);
+            else if (errno != EAGAIN)
+                perror("recvmmsg");
+            return;
+        }
+        for (i = 0; i < n; i++)
+        {
+            char *buf = gro_bufs + i * CONN_GRO_BUFSIZE;
+
+            segsize = gro_segsize(i);
+            if (segsize > (int)server_pktsize)
+                continue;
+            for (off = 0; off < (int)recvq[i].msg_len; off += len)
+            {
+                len = recvq[i].msg_len - off < segsize
+                      ? recvq[i].msg_len - off : segsize;
+                if (opt_debug)
+                    print_pkt((packet_t *)(buf + off), "recv", len);
+                server_deliver((packet_t *)(buf + off), len, &server_from[i]);
+            }
+        }
+        return;
+    }
+#endif /* HAVE_UDP_OFFLOAD */
+#if HAVE_MMSG
+    if (opt_batch > 1)
+    {
+        int i;
+
+        for (i = 0; i < opt_batch; i++)
+        {
+            recvq_iov[i].iov_base = server_pkts + i * server_pktsize;
+            recvq_iov[i].iov_len = server_pktsize;
+            memset(&recvq[i].msg_hdr, 0, sizeof(recvq[i].msg_hdr));
+            recvq[i].msg_hdr.msg_iov = &recvq_iov[i];
+            recvq[i].msg_hdr.msg_iovlen = 1;
+            recvq[i].msg_hdr.msg_name = &server_from[i];
+            recvq[i].msg_hdr.msg_namelen = sizeof(server_from[i]);
+        }
+        n = recvmmsg(serverconf->udp_socket, recvq, opt_batch, 0, NULL);
+        if (n < 0)
+        {
+            if (opt_debug)
+                print_pkt(NULL, "recv", n);
+            else if (errno != EAGAIN)
+                perror("recvmmsg");
+            return;
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (opt_debug)
+                print_pkt((packet_t *)(server_pkts + i * server_pktsize),
+                          "recv", recvq[i].msg_len);
+            server_deliver((packet_t *)(server_pkts + i * server_pktsize),
+                           recvq[i].msg_len, &server_from[i]);
+        }
+        return;
+    }
+#endif /* HAVE_MMSG */
+
+    n = debug_recv(serverconf->udp_socket, (packet_t *)server_pkts,
+                   server_pktsize, 0, &server_from[0]);
+    if (n < 0)
+    {
+        if (errno != EAGAIN)
+            perror("recvfrom");
+        return;
+    }
+    server_deliver((packet_t *)server_pkts, n, &server_from[0]);
+}
+
+/* With DF set, an ICMP "fragmentation needed" lowers the kernel's path
+ * MTU (see conn_mtu) and leaves EMSGSIZE pending on a connected socket:
+ * unlike a port unreachable, no reason to give up on the peer.  Reading
+ * the error clears it. */
+static int
+conn_pmtu_error(int fd)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    return opt_pmtud && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0
+           && err == EMSGSIZE;
+}
+
+/* Handle the events reported for descriptor fd: rc is the connection
+ * reading from it (if any), wc the connection writing to it (if any).
+ * Packets sent meanwhile are flushed in batches afterwards.  Returns
+ * revents, less an error that was only news of the path MTU. */
+static int
+conn_dispatch(conn_t *rc, conn_t *wc, int fd, int revents,
+              const struct config_common *cc)
+{
+    if ((revents & POLLERR) && rc && fd == rc->nfd && conn_pmtu_error(fd))
+        revents &= ~POLLERR;
+    if ((revents & (POLLIN | POLLERR | POLLHUP)) && rc && !rc->delete_me)
+    {
+        if (fd == rc->rfd)
+        {
+            rc->xoff = 1;
+            conn_wantread(rc, 0);
+            rel_read(rc->rel);
+        }
+        else if (fd == rc->nfd && (revents & (POLLERR | POLLHUP)))
+        {
+            char addr[NI_MAXHOST] = "unknown";
+            char port[NI_MAXSERV] = "unknown";
+            getnameinfo((const struct sockaddr *)&rc->peer, sizeof(rc->peer),
+                        addr, sizeof(addr), port, sizeof(port),
+                        NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
+            fprintf(stderr, "[received ICMP port unreachable;"
+                            " assuming peer at %s:%s is dead]\n",
+                    addr, port);
+            if (cc->single_connection)
+                exit(1);
+            rel_destroy(rc->rel);
+        }
+        else if (fd == rc->nfd && !rc->server)
+            conn_recv(rc);
+    }
+    if ((revents & (POLLOUT | POLLHUP | POLLERR)) && wc)
+        conn_drain(wc);
+    conn_flushall();
+    return revents;
+}
+
+static void
+conn_poll_poll(const struct config_common *cc, long timeout)
 {
     int i;
-    conn_t *c, *nc;
-    static int last_cg;
+    static __thread int last_cg;
 
     if (last_cg != cevents_generation)
     {
@@ -502,55 +1592,23 @@ void conn_poll(const struct config_common *cc)
     }
 
     if (cevents[0].fd >= 0)
-        poll(cevents, ncevents, need_timer_in(&last_timeout, cc->timer));
+        poll(cevents, ncevents, timeout);
     else
-        poll(cevents + 1, ncevents - 1, need_timer_in(&last_timeout, cc->timer));
+        poll(cevents + 1, ncevents - 1, timeout);
+
+    /* The server's UDP socket */
+    if (cevents[0].revents & POLLIN)
+    {
+        server_recv();
+        conn_flushall();
+    }
+    cevents[0].revents = 0;
 
     for (i = 1; i < ncevents; i++)
     {
-        if (cevents[i].revents & (POLLIN | POLLERR | POLLHUP))
-        {
-            if ((c = evreaders[i]) && !c->delete_me)
-            {
-                if (cevents[i].fd == c->rfd)
-                {
-                    c->xoff = 1;
-                    cevents[i].events &= ~POLLIN;
-                    rel_read(c->rel);
-                }
-                else if (cevents[i].fd == c->nfd && (cevents[i].revents & (POLLERR | POLLHUP)))
-                {
-                    char addr[NI_MAXHOST] = "unknown";
-                    char port[NI_MAXSERV] = "unknown";
-                    getnameinfo((const struct sockaddr *)&c->peer, sizeof(c->peer),
-                                addr, sizeof(addr), port, sizeof(port),
-                                NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
-                    fprintf(stderr, "[received ICMP port unreachable;"
-                                    " assuming peer at %s:%s is dead]\n",
-                            addr, port);
-                    if (cc->single_connection)
-                        exit(1);
-                    rel_destroy(c->rel);
-                }
-                else if (cevents[i].fd == c->nfd && !c->server)
-                {
-                    packet_t pkt;
-                    int len = debug_recv(c->nfd, &pkt, sizeof(pkt), 0, NULL);
-                    if (len < 0)
-                    {
-                        if (errno != EAGAIN)
-                            perror("recv");
-                    }
-                    else
-                    {
-                        rel_recvpkt(c->rel, &pkt, len);
-                        memset(&pkt, 0xc9, len); /* for debugging */
-                    }
-                }
-            }
-        }
-        if ((cevents[i].revents & (POLLOUT | POLLHUP | POLLERR)) && evwriters[i])
-            conn_drain(evwriters[i]);
+        cevents[i].revents = conn_dispatch(evreaders[i], evwriters[i],
+                                           cevents[i].fd, cevents[i].revents,
+                                           cc);
         if (cevents[i].revents & (POLLHUP | POLLERR))
         {
 #if 0
@@ -565,11 +1623,79 @@ void conn_poll(const struct config_common *cc)
         }
         cevents[i].revents = 0;
     }
+}
+
+#if HAVE_EPOLL
+static void
+evsource_dispatch(struct evsource *src, int revents,
+                  const struct config_common *cc)
+{
+    conn_t *c = src->c;
+
+    /* epoll's event bits are those of poll() */
+    if (c)
+        revents = conn_dispatch(src == c->rsrc || src == c->nsrc ? c : NULL,
+                                src == c->wsrc ? c : NULL, src->fd, revents,
+                                cc);
+    else if (src == &server_src && (revents & EPOLLIN))
+    {
+        server_recv();
+        conn_flushall();
+    }
+    if (revents & (EPOLLHUP | EPOLLERR))
+    {
+        /* If stderr has an error, the tester has probably died, so exit
+         * immediately. */
+        if (src == &stderr_src)
+            exit(1);
+        evsource_del(src);
+    }
+}
+
+static void
+conn_poll_epoll(const struct config_common *cc, long timeout)
+{
+    struct epoll_event ev[64];
+    struct evsource *src, *nsrc;
+    int i, n;
+
+    for (src = always_ready; src; src = src->next)
+        if (src->events)
+            timeout = 0;
+
+    n = epoll_wait(epfd, ev, sizeof(ev) / sizeof(ev[0]), timeout);
+    for (i = 0; i < n; i++)
+        evsource_dispatch(ev[i].data.ptr, ev[i].events, cc);
+
+    for (src = always_ready; src; src = nsrc)
+    {
+        nsrc = src->next;
+        if (src->events)
+            evsource_dispatch(src, src->events, cc);
+    }
+}
+#endif /* HAVE_EPOLL */
+
+void conn_poll(const struct config_common *cc)
+{
+    conn_t *c, *nc;
 
-    if (need_timer_in(&last_timeout, cc->timer) == 0)
+    /* In case packets were sent outside of a callback */
+    conn_flushall();
+
+    /* Sleep until the earliest timer of the reliable layer is due
+     * (-1, i.e. forever, if none is armed) */
+#if HAVE_EPOLL
+    if (epfd >= 0)
+        conn_poll_epoll(cc, rel_timeout());
+    else
+#endif /* HAVE_EPOLL */
+        conn_poll_poll(cc, rel_timeout());
+
+    if (rel_timeout() == 0)
     {
         rel_timer();
-        clock_gettime(CLOCK_MONOTONIC, &last_timeout);
+        conn_flushall();
     }
 
     for (c = conn_list; c; c = nc)
@@ -580,22 +1706,6 @@ void conn_poll(const struct config_common *cc)
     }
 }
 
-uint16_t
-cksum(const void *_data, int len)
-{
-    const uint8_t *data = _data;
-    uint32_t sum;
-
-    for (sum = 0; len >= 2; data += 2, len -= 2)
-        sum += data[0] << 8 | data[1];
-    if (len > 0)
-        sum += data[0] << 8;
-    while (sum > 0xffff)
-        sum = (sum >> 16) + (sum & 0xffff);
-    sum = htons(~sum);
-    return sum ? sum : 0xffff;
-}
-
 int make_async(int s)
 {
     int n;
@@ -772,6 +1882,39 @@ int listen_on(int dgram, struct sockaddr_storage *ss)
     }
     if (!dgram)
         setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char *)&n, sizeof(n));
+    else if (opt_threads > 1)
+        setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (char *)&n, sizeof(n));
+#if defined(IP_MTU_DISCOVER) && defined(IPV6_MTU_DISCOVER)
+    /* Never fragment, so that a datagram either makes it through whole or
+     * not at all: probes then tell the path MTU, and anything above what
+     * the kernel knows of it fails with EMSGSIZE */
+    if (dgram && opt_pmtud)
+    {
+        int pmtudisc;
+        if (ss->ss_family == AF_INET6)
+        {
+            pmtudisc = IPV6_PMTUDISC_DO;
+            setsockopt(s, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &pmtudisc,
+                       sizeof(pmtudisc));
+        }
+        else
+        {
+            pmtudisc = IP_PMTUDISC_DO;
+            setsockopt(s, IPPROTO_IP, IP_MTU_DISCOVER, &pmtudisc,
+                       sizeof(pmtudisc));
+        }
+    }
+#endif /* IP_MTU_DISCOVER && IPV6_MTU_DISCOVER */
+#if HAVE_UDP_OFFLOAD
+    /* Setting a GSO size of 0 (none by default) fails on kernels that
+     * cannot segment at all */
+    if (dgram && opt_offload && opt_batch > 1)
+    {
+        int off = 0;
+        udp_gso = setsockopt(s, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0;
+        udp_gro = setsockopt(s, SOL_UDP, UDP_GRO, &n, sizeof(n)) == 0;
+    }
+#endif /* HAVE_UDP_OFFLOAD */
     if (bind(s, (const struct sockaddr *)ss, addrsize(ss)) < 0)
     {
         perror("bind");
@@ -850,11 +1993,124 @@ debug_recv(int s, packet_t *buf, size_t len, int flags,
     return n;
 }
 
+/* Set up the event loop and scratch space of the calling thread */
+static void
+conn_loop_init(void)
+{
+#if HAVE_MMSG
+    if (opt_batch > 1)
+    {
+        int gsoq_len = opt_batch < CONN_GSO_SEGMENTS ? CONN_GSO_SEGMENTS
+                                                     : opt_batch;
+
+        recvq = xmalloc(opt_batch * sizeof(*recvq));
+        /* with GRO, a client receives each datagram into two buffers */
+        recvq_iov = xmalloc((udp_gro ? 2 : 1) * opt_batch
+                            * sizeof(*recvq_iov));
+        recvq_pkts = xmalloc(opt_batch * sizeof(*recvq_pkts));
+        gsoq = xmalloc(gsoq_len * sizeof(*gsoq));
+        gsoq_segs = xmalloc(gsoq_len * sizeof(*gsoq_segs));
+        gsoq_cmsg = xmalloc(gsoq_len * sizeof(*gsoq_cmsg));
+        if (udp_gro)
+        {
+            recvq_cmsg = xmalloc(opt_batch * sizeof(*recvq_cmsg));
+            gro_bufs = xmalloc(opt_batch * CONN_GRO_BUFSIZE);
+        }
+    }
+#endif /* HAVE_MMSG */
+
+#if HAVE_EPOLL
+    /* Fall back to poll() if epoll is unavailable */
+    if (!opt_poll && (epfd = epoll_create1(0)) < 0)
+        perror("epoll_create1");
+    if (epfd >= 0)
+        evsource_add(&stderr_src, NULL, 2, 0); /* Do catch errors on stderr */
+#endif /* HAVE_EPOLL */
+}
+
+/* Event loop of a server thread, relaying the peers hashed to its socket */
+static void *
+server_run(void *arg)
+{
+    struct server_thread *st = arg;
+
+    if (st->cpu >= 0)
+    {
+        cpu_set_t set;
+        int err;
+
+        CPU_ZERO(&set);
+        CPU_SET(st->cpu, &set);
+        if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)))
+            fprintf(stderr, "CPU %d: %s\n", st->cpu, strerror(err));
+    }
+
+    serverconf = &st->sc;
+    server_pktsize = REL_PKT_SIZE(st->sc.c.mss);
+    server_pkts = xmalloc(opt_batch * server_pktsize);
+    server_from = xmalloc(opt_batch * sizeof(*server_from));
+    conn_loop_init();
+
+#if HAVE_EPOLL
+    if (epfd >= 0)
+        evsource_add(&server_src, NULL, st->sc.udp_socket, EPOLLIN);
+    else
+#endif /* HAVE_EPOLL */
+    {
+        conn_mkevents();
+        cevents[0].fd = st->sc.udp_socket;
+        cevents[0].events = POLLIN;
+    }
+    for (;;)
+        conn_poll(&st->sc.c);
+    return NULL;
+}
+
+/* Parse the CPUs to pin server threads to: "auto" for the CPUs the
+ * process may run on, in order, or a comma-separated list.  Returns the
+ * number of CPUs, 0 if the list is invalid. */
+static int
+parse_cpus(const char *list, int *cpus, int max)
+{
+    int n = 0;
+
+    if (!strcmp(list, "auto"))
+    {
+        cpu_set_t set;
+        int cpu;
+
+        if (sched_getaffinity(0, sizeof(set), &set) < 0)
+        {
+            perror("sched_getaffinity");
+            return 0;
+        }
+        for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++)
+            if (CPU_ISSET(cpu, &set))
+                cpus[n++] = cpu;
+        return n;
+    }
+
+    while (*list && n < max)
+    {
+        char *end;
+        long cpu = strtol(list, &end, 10);
+
+        if (end == list || (*end && *end != ',') || cpu < 0 || cpu >= CPU_SETSIZE)
+            return 0;
+        cpus[n++] = cpu;
+        list = *end ? end + 1 : end;
+    }
+    return n;
+}
+
 static void
 usage(void)
 {
     fprintf(stderr,
-            "usage: %s udp-port [host:]udp-port\n", progname);
+            "usage: %s [options] udp-port [host:]udp-port\n"
+            "       %s -s [-T threads] [-A auto|cpu,...] [options]"
+            " udp-port [host:]tcp-port\n",
+            progname, progname);
     exit(1);
 }
 
@@ -863,10 +2119,31 @@ int main(int argc, char **argv)
     struct option o[] = {
         {"debug", no_argument, NULL, 'd'},
         {"window", required_argument, NULL, 'w'},
+        {"stats", no_argument, NULL, 'S'},
+        {"events", required_argument, NULL, 'e'},
+        {"batch", required_argument, NULL, 'b'},
+        {"dupack", required_argument, NULL, 'D'},
+        {"cc", required_argument, NULL, 'C'},
+        {"server", no_argument, NULL, 's'},
+        {"threads", required_argument, NULL, 'T'},
+        {"affinity", required_argument, NULL, 'A'},
+        {"ack-every", required_argument, NULL, 'a'},
+        {"ack-delay", required_argument, NULL, 'y'},
+        {"outbuf", required_argument, NULL, 'o'},
+        {"mss", required_argument, NULL, 'm'},
+        {"pmtud", no_argument, NULL, 'P'},
+        {"offload", required_argument, NULL, 'O'},
+        {"nodelay", no_argument, NULL, 'N'},
+        {"cork-timeout", required_argument, NULL, 'k'},
         {NULL, 0, NULL, 0}};
     int opt;
+    int server = 0;
+    static int cpus[CPU_SETSIZE];
+    int ncpus = 0;
+    int nfd;
     char *local = NULL;
     char *remote = NULL;
+    long outbuf = 0;
     struct config_common c;
     struct sigaction sa;
 
@@ -878,6 +2155,11 @@ int main(int argc, char **argv)
     memset(&c, 0, sizeof(c));
     c.window = 1;
     c.timeout = 2000;
+    c.dupacks = 3;
+    c.congestion = "none";
+    c.ack_every = 1;
+    c.ack_delay = 40;
+    c.cork_timeout = 200;
 
     progname = strrchr(argv[0], '/');
     if (progname)
@@ -885,12 +2167,71 @@ int main(int argc, char **argv)
     else
         progname = argv[0];
 
-    while ((opt = getopt_long(argc, argv, "cdust:w:l", o, NULL)) != -1)
+    while ((opt = getopt_long(argc, argv, "a:A:b:C:cdD:e:k:m:No:O:Pust:T:w:y:lS", o, NULL)) != -1)
         switch (opt)
         {
         case 'd':
             opt_debug = 1;
             break;
+        case 'S':
+            opt_stats = 1;
+            break;
+        case 's':
+            server = 1;
+            break;
+        case 'T':
+            opt_threads = atoi(optarg);
+            break;
+        case 'A':
+            if (!(ncpus = parse_cpus(optarg, cpus, CPU_SETSIZE)))
+                usage();
+            break;
+        case 'b':
+            opt_batch = atoi(optarg);
+            break;
+        case 'D':
+            c.dupacks = atoi(optarg);
+            break;
+        case 'a':
+            c.ack_every = atoi(optarg);
+            break;
+        case 'y':
+            c.ack_delay = atoi(optarg);
+            break;
+        case 'o':
+            outbuf = atol(optarg);
+            break;
+        case 'm':
+            c.mss = atoi(optarg);
+            break;
+        case 'P':
+            c.pmtud = opt_pmtud = 1;
+            break;
+        case 'N':
+            c.nodelay = 1;
+            break;
+        case 'k':
+            c.cork_timeout = atoi(optarg);
+            break;
+        case 'C':
+            c.congestion = optarg;
+            break;
+        case 'O':
+            if (!strcmp(optarg, "on"))
+                opt_offload = 1;
+            else if (!strcmp(optarg, "off"))
+                opt_offload = 0;
+            else
+                usage();
+            break;
+        case 'e':
+            if (!strcmp(optarg, "poll"))
+                opt_poll = 1;
+            else if (!strcmp(optarg, "epoll"))
+                opt_poll = 0;
+            else
+                usage();
+            break;
         case 'l':
         {
             char name[40];
@@ -915,35 +2256,97 @@ int main(int argc, char **argv)
             break;
         }
 
-    if (optind + 2 != argc || c.window < 1 || c.timeout < 10)
+    /* Probing finds the segment size, up to the largest the peer takes */
+    if (!c.mss)
+        c.mss = c.pmtud ? REL_MSS_MAX : REL_MSS_DEFAULT;
+
+    if (optind + 2 != argc || c.window < 1 || c.timeout < 10 || opt_batch < 1
+        || c.dupacks < 0 || !congestion_lookup(c.congestion)
+        || opt_threads < 1 || (opt_threads > 1 && !server)
+        || c.ack_every < 1 || c.ack_delay < 0 || c.ack_delay > 500
+        || c.cork_timeout < 1 || c.cork_timeout > 1000
+        || c.mss < REL_MSS_DEFAULT || c.mss > REL_MSS_MAX
+        || outbuf < 0 || (outbuf > 0 && outbuf < c.mss))
     {
         usage();
     }
 
+    opt_outbuf = outbuf ? (size_t)outbuf : (size_t)c.window * c.mss;
+    if (!outbuf && opt_outbuf < CONN_OUTBUF_MIN)
+        opt_outbuf = CONN_OUTBUF_MIN;
+
+#if !HAVE_MMSG
+    opt_batch = 1;
+#endif /* !HAVE_MMSG */
+
     c.timer = c.timeout / 5;
     local = argv[optind];
     remote = argv[optind + 1];
 
     struct sockaddr_storage sl, sr;
-    conn_t *cn = conn_alloc();
-    c.single_connection = 1;
-    cn->rfd = 0;
-    cn->wfd = 1;
-    if (get_address(&sr, 0, 1, AF_INET, remote) < 0 || get_address(&sl, 1, 1, sr.ss_family, local) < 0 || (cn->nfd = listen_on(1, &sl)) < 0)
+
+    /* As a server, relay each peer sending to the UDP port to its own TCP
+     * connection to the remote address */
+    if (server)
+    {
+        struct server_thread *st = xmalloc(opt_threads * sizeof(*st));
+        int server_rcvbuf = SERVER_RCVBUF;
+        int i, err;
+
+        if (get_address(&sr, 0, 0, AF_INET, remote) < 0 || get_address(&sl, 1, 1, AF_INET, local) < 0)
+            exit(1);
+        memset(st, 0, opt_threads * sizeof(*st));
+        for (i = 0; i < opt_threads; i++)
+        {
+            st[i].sc.c = c;
+            st[i].sc.dest = sr;
+            st[i].cpu = ncpus ? cpus[i % ncpus] : -1;
+            /* Once bound, sl holds the port all threads share */
+            if ((st[i].sc.udp_socket = listen_on(1, &sl)) < 0)
+                exit(1);
+            make_async(st[i].sc.udp_socket);
+            /* All peers of a thread share its socket's receive buffer; the
+             * kernel caps the size at net.core.rmem_max */
+            setsockopt(st[i].sc.udp_socket, SOL_SOCKET, SO_RCVBUF,
+                       &server_rcvbuf, sizeof(server_rcvbuf));
+        }
+        for (i = 1; i < opt_threads; i++)
+            if ((err = pthread_create(&st[i].thread, NULL, server_run, &st[i])))
+            {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err));
+                exit(1);
+            }
+        server_run(&st[0]);
+    }
+
+    if (get_address(&sr, 0, 1, AF_INET, remote) < 0 || get_address(&sl, 1, 1, sr.ss_family, local) < 0 || (nfd = listen_on(1, &sl)) < 0)
         exit(1);
-    if (connect(cn->nfd, (struct sockaddr *)&sr, addrsize(&sr)) < 0)
+    if (connect(nfd, (struct sockaddr *)&sr, addrsize(&sr)) < 0)
     {
         perror("connect");
         exit(1);
     }
-    cn->server = 0;
+    if (c.mss > REL_MSS_DEFAULT)
+    {
+        /* Room for a window of the largest packets either way (the kernel
+         * caps the sizes at net.core.rmem_max and wmem_max) */
+        int bufsize = c.window * REL_PKT_SIZE(c.mss);
+        setsockopt(nfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+        setsockopt(nfd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    }
+    conn_loop_init();
+    conn_t *cn = conn_alloc(&c, 0, 1, nfd, 0);
+    c.single_connection = 1;
     cn->peer = sr;
     make_async(cn->rfd);
     make_async(cn->wfd);
     make_async(cn->nfd);
     cn->rel = rel_create(cn, NULL, &c);
 
-    conn_mkevents();
+#if HAVE_EPOLL
+    if (epfd < 0)
+#endif /* HAVE_EPOLL */
+        conn_mkevents();
     while (conn_list)
         conn_poll(&c);
 
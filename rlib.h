@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* -----------------------------------------------------------------------
 
@@ -14,7 +15,8 @@
 
    There are two kinds of packets, Data packets and Ack-only packets.
    You can tell the type of a packet by length.  Ack packets are 8
-   bytes, while Data packets vary from 12 to 500 bytes.
+   bytes, while Data packets vary from 12 to 12 + REL_MSS_DEFAULT (500)
+   bytes, or up to 12 + the MSS the peers agreed on (REL_OPT_MSS).
 
    Every Data packet contains a 32-bit sequence number as well as 0 or
    more bytes of payload.
@@ -58,11 +60,11 @@
             cannot be merged with another packet for retransmission.
 
    - data:  Contains (len - 12) bytes of payload data for the
-            application.
+            application, at most the MSS.
 
    To conserve packets, a sender should not send more than one
-   unacknowledged Data frame with less than the maximum number of
-   packets (500), somewhat like TCP's Nagle algorithm.
+   unacknowledged Data frame with less than the maximum payload (the
+   MSS), somewhat like TCP's Nagle algorithm.
 
  */
 
@@ -74,15 +76,106 @@ struct ack_packet {
     uint32_t ackno;
 };
 
+/* Payload bytes per Data packet: REL_MSS_DEFAULT unless both peers
+ * announce more, up to what fits into a UDP datagram over IPv4 */
+#define REL_MSS_DEFAULT 500
+#define REL_MSS_MAX (65507 - 12)
+
 struct packet {
     uint16_t cksum;
     uint16_t len;
     uint32_t ackno;
     uint32_t seqno;		/* Only valid if length > 8 */
-    char data[500];
+    char data[];		/* (len - 12) bytes */
 };
 typedef struct packet packet_t;
 
+/* Bytes to allocate for a packet with up to n bytes of payload */
+#define REL_PKT_SIZE(n) (sizeof(struct packet) + (n))
+
+/* Extended Ack packets.
+
+   A packet with a seqno of 0, which no data packet carries, is an
+   extended Ack.  Its ackno is cumulative as in an Ack packet, and its
+   (len - 12) bytes of payload are a list of options, each made of a
+   kind byte, a length byte (counting the kind and length bytes) and
+   a value.  Options of unknown kind are skipped.
+
+   A peer that does not know extended Acks takes them for data outside
+   its window and drops them.  Extended Acks carrying anything but a
+   HELLO are therefore only sent to peers that announced support for
+   them in their HELLO, which goes out in an extended Ack of its own
+   once the peer has been heard from, and again with exponential
+   backoff until the peer's HELLO arrives.  A sender that never gets
+   an Ack thus never sends anything but data.
+
+   - REL_OPT_HELLO: the 32-bit capability bits (REL_CAP_*) of the
+     sender, big-endian.  A HELLO with REL_CAP_HELLO_REPLY set answers
+     a HELLO and is not answered again.
+
+   - REL_OPT_SACK: bitmap of the packets the sender holds above
+     ackno, bit i (least significant first within each byte) standing
+     for seqno ackno + 1 + i.  It is at most REL_SACK_MAX_BYTES long,
+     so that an extended Ack with a SACK and a window fits into
+     CONN_SMALL_PKT bytes: with a window of more than
+     8 * REL_SACK_MAX_BYTES + 1 packets, those held further above ackno
+     go unreported, and holes among them are repaired as without SACK
+     (on duplicate Acks or timeouts).
+
+   - REL_OPT_WINDOW: the 32-bit number of packets, big-endian, the
+     sender has room for from ackno on, so its peer may send up to
+     seqno ackno + window - 1.  A window of 0 asks the peer to stop,
+     sending one packet now and then to learn when it opens again.
+
+   - REL_OPT_MSS: the 32-bit payload size, big-endian, of the largest
+     Data packet the sender takes, at least REL_MSS_DEFAULT.  It goes
+     into the HELLO extended Ack; each peer then sends packets of up
+     to the smaller of the two sizes (REL_MSS_DEFAULT until the HELLO
+     of its peer arrives).
+
+   - REL_OPT_PROBE: the 32-bit payload size, big-endian, of a Data
+     packet the extended Ack stands in for: it is exactly that long,
+     the rest of it zero bytes, which end the list of options.  Only
+     sent to peers with REL_CAP_PMTUD, which answer every one that
+     arrives with an extended Ack carrying REL_OPT_PROBE_ACK and the
+     same value.  A sender probing the path MTU thus learns which
+     packet sizes make it through whole.
+
+   Capabilities:
+
+   - REL_CAP_SACK: the sender understands REL_OPT_SACK.
+
+   - REL_CAP_PIGGYBACK: the sender takes the ackno of a data packet
+     for an Ack, so Acks may ride on data instead of going out in
+     packets of their own.
+
+   - REL_CAP_WINDOW: the sender keeps to the REL_OPT_WINDOW its peer
+     advertises.  Acks to it also cover the packets held in order for
+     output, which the window then no longer counts, rather than stop
+     while the output buffer is full.
+
+   - REL_CAP_PMTUD: the sender answers REL_OPT_PROBE.
+ */
+#define REL_OPT_HELLO 1
+#define REL_OPT_SACK 2
+#define REL_OPT_WINDOW 3
+#define REL_OPT_MSS 4
+#define REL_OPT_PROBE 5
+#define REL_OPT_PROBE_ACK 6
+
+#define REL_CAP_SACK 0x00000001
+#define REL_CAP_PIGGYBACK 0x00000002
+#define REL_CAP_WINDOW 0x00000004
+#define REL_CAP_PMTUD 0x00000008
+#define REL_CAP_HELLO_REPLY 0x80000000
+
+/* Packets up to this length are copied by conn_sendpkt */
+#define CONN_SMALL_PKT 64
+
+/* Longest REL_OPT_SACK bitmap (352 packets): what is left of
+   CONN_SMALL_PKT after the header and a REL_OPT_WINDOW option */
+#define REL_SACK_MAX_BYTES (CONN_SMALL_PKT - 12 - 2 - (2 + 4))
+
 /* -----------------------------------------------------------------------
 
    Important notes about the library:
@@ -91,11 +184,17 @@ typedef struct packet packet_t;
 
      <local-IP-address, local-UDP-port, remote-IP-address, remote-UDP-port>
 
-     In stand-alone mode, and in the client, the task of connection
-     demultiplexing is handled automatically for you.  In server
-     mode, you must demultiplex packets yourself.  A useful function
-     for this is addreq(), which compares two sockaddr_storage
-     structures and tells you if they are the same.
+     Connection demultiplexing is handled automatically for you.  In
+     server mode (-s), all peers share one UDP socket; the library
+     looks up the connection of each datagram's sender in a hash table
+     keyed by addrhash(), and calls rel_create with a NULL conn_t
+     (see conn_create) on the first packet of a new peer.
+
+     With -T, the server runs an event loop per thread, each with its
+     own socket bound to the same port (SO_REUSEPORT), and a peer always
+     hashes to the same thread.  All callbacks for a connection come
+     from that thread, so global state in reliable.c (a list of all
+     connections, timers) must be thread-local (__thread).
 
    * The configuration of the program is described by a structure
      config_common that gets passed to various functions.  The most
@@ -111,6 +210,9 @@ typedef struct packet packet_t;
                   function clock_gettime with parameter
                   CLOCK_MONOTONIC useful for keeping track of when
                   packets are sent.  Run "man clock_gettime".
+                  reliable.c uses it as the initial retransmission
+                  timeout and adapts it to the measured round-trip
+                  time (RFC 6298).
 
    * Your task is to implement the following six functions:
 
@@ -151,6 +253,9 @@ typedef struct packet packet_t;
    * When a packet is received, the library will call either
      rel_recvpkt.  The library already knows what rel_t to use for the
      particular UDP port receiving the packet, and supplies you with the rel_t.
+     The packet is received directly into an object of the connection's
+     pool (conn_pool), and rel_recvpkt takes ownership of it: either keep
+     it (e.g., in your receive buffer) or give it back with pool_put.
 
    * To get the input data that you must send in your packets, call
      conn_input.  If no data is available, conn_input will return 0.
@@ -167,33 +272,50 @@ typedef struct packet packet_t;
      point you can send out more Acks to get more data from the remote
      side.
 
-   * The function rel_timer is called periodically, currently at a
-     rate 1/5 of the retransmission interval.  You can use this timer
-     to inspect packets and retransmit packets that have not been
+   * The function rel_timer is called when the earliest deadline of
+     the reliable layer is due, as reported by rel_timeout.  You can
+     use this timer to retransmit packets that have not been
      acknowledged.  Do not retransmit every packet every time the
      timer is fired!  You must keep track of which packets need to be
-     retransmitted when.
+     retransmitted when.  The library sleeps in poll/epoll_wait for
+     at most rel_timeout milliseconds, so there is no periodic wakeup
+     when no timer is armed.
 
 */
 
 struct config_common {
     int window;			/* # of unacknowledged packets in flight */
     int timer;			/* How often rel_timer called in milliseconds */
-    int timeout;			/* Retransmission timeout in milliseconds */
+    int timeout;			/* Initial retransmission timeout in milliseconds */
     int single_connection;        /* Exit after first connection failure */
+    int dupacks;			/* Duplicate ACKs that trigger a fast
+				   retransmit (0 to disable) */
+    const char *congestion;	/* Congestion control algorithm */
+    int ack_every;		/* ACK at least every this many in-order
+				   packets received... */
+    int ack_delay;		/* ...or this many milliseconds after
+				   the first of them */
+    int mss;			/* Largest payload we send and take */
+    int pmtud;			/* Probe the path MTU for the payload
+				   of the packets we send */
+    int nodelay;			/* Send short packets right away,
+				   rather than coalesce input... */
+    int cork_timeout;		/* ...for at most this many
+				   milliseconds */
 };
 
 typedef struct reliable_state rel_t;
 
 extern char *progname;		/* Set to name of program by main */
 extern int opt_debug;		/* When != 0, print packets */
+extern int opt_stats;		/* When != 0, print statistics on teardown */
 
 #if !DMALLOC
 void *xmalloc (size_t);
 #endif /* !DMALLOC */
 
 /**
- * compute TCP-like checksum
+ * compute TCP-like checksum (see cksum.h for the implementations)
  *
  * @param   data      Pointer to packet over which cksum is computed
  *
@@ -228,9 +350,30 @@ typedef struct conn conn_t;
  * NULL conn_t. */
 conn_t *conn_create (rel_t *, const struct sockaddr_storage *);
 
+/* Each connection owns a pool (see pool.h) of preallocated objects,
+ * each large enough to hold a packet_t, sized by the window.  Draw
+ * your packets from it so the steady state does not touch the heap.
+ * The pool lives until the connection is freed by the library, which
+ * happens after rel_destroy returns. */
+struct pool;
+struct pool *conn_pool (conn_t *c);
+
+/* With --pmtud, datagrams are sent with DF set, so those larger than
+ * the path MTU are dropped on the way rather than fragmented, and those
+ * larger than the kernel's idea of it fail right away.  This returns
+ * the largest datagram payload that idea allows (0 if the kernel has
+ * none, e.g. on the server, or without --pmtud). */
+size_t conn_mtu (conn_t *c);
+
 /**
  * Call this function to send a UDP packet to the other side.
  *
+ * Packets are queued and sent in batches (sendmmsg) once the current
+ * rel_* callback returns, each run of packets of one size as a single
+ * datagram the kernel segments (UDP GSO) where it can.  Packets of up to CONN_SMALL_PKT bytes (acks,
+ * extended acks, EOF) are copied into the queue, longer ones must stay
+ * valid until then (see conn_flush), as they do in your send buffer.
+ *
  * @param   pkt      Pointer to packet to be sent
  *
  * @param   len      Length of the packet
@@ -239,9 +382,19 @@ conn_t *conn_create (rel_t *, const struct sockaddr_storage *);
  */
 int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
 
+/**
+ * Call this function to send the packets conn_sendpkt has queued right
+ * away, before freeing one of them that may still be queued (e.g. a
+ * retransmission the peer acknowledges in the same receive batch).
+ * conn_destroy does so itself.
+ */
+void conn_flush (conn_t *c);
+
 /* This function tells you how many bytes of output buffering are free
  * for conn_output to store your data.  conn_output is guaranteed not
- * to return 0 if you write less than this many bytes. */
+ * to return 0 if you write less than this many bytes.  The buffer
+ * holds a window of full packets (at least 8192 bytes) unless set with
+ * --outbuf, and this takes constant time. */
 size_t conn_bufspace (conn_t *c);
 
 /* Call this function to produce output from the UDP packets you have
@@ -262,6 +415,18 @@ size_t conn_bufspace (conn_t *c);
  **/
 int conn_output (conn_t *c, const void *buf, size_t len);
 
+/* Like conn_output, but writes the buffers of iov in order with a
+ * single writev, so that several packets can be output without
+ * concatenating them first.  Returns the total number of bytes
+ * accepted, or -1 on error.  Unlike conn_output, a total length of 0
+ * does not send an EOF.
+ *
+ * @param   iov      Array of buffers to be written to output
+ *
+ * @param   iovcnt   number of buffers in iov
+ **/
+int conn_outputv (conn_t *c, const struct iovec *iov, int iovcnt);
+
 /* Get some input from the reliable side.  You must must then put the
  * data into UDP sockets which you send out with conn_sendpkt.  This
  * function returns the number of bytes received, 0 if there is no
@@ -273,6 +438,17 @@ int conn_output (conn_t *c, const void *buf, size_t len);
  */
 int conn_input (conn_t *c, void *buf, size_t len);
 
+/* Like conn_input, but reads into the buffers of iov in order with a
+ * single readv, so that the payloads of several packets can be read at
+ * once.  Returns the total number of bytes read, 0 if no data is
+ * currently available, and -1 on EOF or error.
+ *
+ * @param   iov      Array of buffers to be filled from input
+ *
+ * @param   iovcnt   number of buffers in iov
+ */
+int conn_inputv (conn_t *c, const struct iovec *iov, int iovcnt);
+
 /* Deallocate a connection */
 void conn_destroy (conn_t *c);
 
@@ -282,13 +458,17 @@ rel_t *rel_create (conn_t *, const struct sockaddr_storage *,
 		   const struct config_common *);
 void rel_destroy (rel_t *);
 
-/* This function gets called on clients, when packets arrive: */
+/* This function gets called on clients, when packets arrive.  pkt is
+ * drawn from conn_pool and owned by the callee from then on: */
 void rel_recvpkt (rel_t *, packet_t *pkt, size_t len);
 
 /* Notification handlers */
 void rel_read (rel_t *);    /* Invoked when you can call conn_input */
 void rel_output (rel_t *);  /* Invoked when some output drained */
-void rel_timer (void); /* Invoked roughly each timer/5 milliseconds */
+void rel_timer (void); /* Invoked when rel_timeout returns 0 */
+/* Milliseconds until rel_timer must be called, 0 if overdue, -1 if
+ * no timer is armed */
+long rel_timeout (void);
 
 
 
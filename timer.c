@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "rlib.h"
+#include "timer.h"
+
+/**
+ * Put an entry at a heap position and record the position in the entry.
+*/
+static void timer_place(timer_heap_t *heap, timer_entry_t *entry, uint32_t i) {
+    heap->entries[i] = entry;
+    entry->index = i + 1;
+}
+
+/**
+ * Move the entry at heap position i up until its parent is not later.
+*/
+static void timer_sift_up(timer_heap_t *heap, uint32_t i) {
+    timer_entry_t* entry = heap->entries[i];
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (heap->entries[parent]->deadline <= entry->deadline) {
+            break;
+        }
+        timer_place(heap, heap->entries[parent], i);
+        i = parent;
+    }
+    timer_place(heap, entry, i);
+}
+
+/**
+ * Move the entry at heap position i down until no child is earlier.
+*/
+static void timer_sift_down(timer_heap_t *heap, uint32_t i) {
+    timer_entry_t* entry = heap->entries[i];
+    while (1) {
+        uint32_t child = 2 * i + 1;
+        if (child >= heap->size) {
+            break;
+        }
+        if (child + 1 < heap->size && heap->entries[child + 1]->deadline < heap->entries[child]->deadline) {
+            child++;
+        }
+        if (entry->deadline <= heap->entries[child]->deadline) {
+            break;
+        }
+        timer_place(heap, heap->entries[child], i);
+        i = child;
+    }
+    timer_place(heap, entry, i);
+}
+
+/**
+ * Arm (or re-arm) a timer entry.
+ *
+ * @param   heap        Pointer to timer heap
+ * @param   entry       Pointer to timer entry
+ * @param   deadline    Expiry time in milliseconds
+*/
+void timer_arm(timer_heap_t *heap, timer_entry_t *entry, long deadline) {
+    if (timer_armed(entry)) {
+        long previous = entry->deadline;
+        entry->deadline = deadline;
+        if (deadline < previous) {
+            timer_sift_up(heap, entry->index - 1);
+        } else {
+            timer_sift_down(heap, entry->index - 1);
+        }
+        return;
+    }
+
+    if (heap->size == heap->capacity) {
+        uint32_t capacity = heap->capacity ? 2 * heap->capacity : 64;
+        timer_entry_t** entries = xmalloc(capacity * sizeof(timer_entry_t*));
+        for (uint32_t i = 0; i < heap->size; i++) {
+            entries[i] = heap->entries[i];
+        }
+        free(heap->entries);
+        heap->entries = entries;
+        heap->capacity = capacity;
+    }
+
+    entry->deadline = deadline;
+    heap->entries[heap->size] = entry;
+    heap->size++;
+    timer_sift_up(heap, heap->size - 1);
+}
+
+/**
+ * Cancel a timer entry (no-op if it is not armed).
+ *
+ * @param   heap        Pointer to timer heap
+ * @param   entry       Pointer to timer entry
+*/
+void timer_cancel(timer_heap_t *heap, timer_entry_t *entry) {
+    if (!timer_armed(entry)) {
+        return;
+    }
+    uint32_t i = entry->index - 1;
+    entry->index = 0;
+    heap->size--;
+    if (i == heap->size) {
+        return;
+    }
+
+    // Fill the hole with the last entry and restore the heap order around it
+    timer_place(heap, heap->entries[heap->size], i);
+    if (i > 0 && heap->entries[(i - 1) / 2]->deadline > heap->entries[i]->deadline) {
+        timer_sift_up(heap, i);
+    } else {
+        timer_sift_down(heap, i);
+    }
+}
+
+/**
+ * Check whether a timer entry is armed.
+ *
+ * @param   entry       Pointer to timer entry
+ *
+ * @return  1 iff armed, 0 otherwise
+*/
+int timer_armed(timer_entry_t *entry) {
+    return entry->index != 0;
+}
+
+/**
+ * Get the armed timer entry with the earliest deadline.
+ *
+ * @param   heap        Pointer to timer heap
+ *
+ * @return  Pointer to timer entry (NULL if none)
+*/
+timer_entry_t* timer_first(timer_heap_t *heap) {
+    return heap->size > 0 ? heap->entries[0] : NULL;
+}
+
+/**
+ * Remove and return the earliest timer entry if it has expired.
+ *
+ * @param   heap        Pointer to timer heap
+ * @param   now         Current time in milliseconds
+ *
+ * @return  Pointer to the expired timer entry, now disarmed (NULL if none is due)
+*/
+timer_entry_t* timer_pop_expired(timer_heap_t *heap, long now) {
+    timer_entry_t* first = timer_first(heap);
+    if (first == NULL || first->deadline > now) {
+        return NULL;
+    }
+    timer_cancel(heap, first);
+    return first;
+}
@@ -0,0 +1,75 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * A timer heap is a binary min-heap of timer entries, ordered by their deadline.
+ *
+ * Timer entries are embedded in the objects they time (e.g. a buffer node waiting for its retransmission),
+ * and the heap only stores pointers to them. Each entry remembers its position in the heap, so that it can
+ * be re-armed or cancelled in O(log n) without searching. Looking at the earliest deadline is O(1), hence
+ * expiry processing only ever touches the entries that are actually due.
+ *
+ * A zeroed timer heap is empty, and a zeroed timer entry is not armed; neither needs further initialization.
+ * The heap array grows on demand.
+*/
+
+typedef struct timer_entry {
+    long deadline;      /* Expiry time in milliseconds */
+    uint32_t index;     /* Position in the heap + 1 (0 iff not armed) */
+    void* arg;          /* Owner of the entry, free for the caller to use */
+} timer_entry_t;
+
+typedef struct timer_heap {
+    timer_entry_t** entries;
+    uint32_t size;
+    uint32_t capacity;
+} timer_heap_t;
+
+/**
+ * Arm (or re-arm) a timer entry.
+ *
+ * @param   heap        Pointer to timer heap
+ * @param   entry       Pointer to timer entry
+ * @param   deadline    Expiry time in milliseconds
+*/
+void timer_arm(timer_heap_t *heap, timer_entry_t *entry, long deadline);
+
+/**
+ * Cancel a timer entry (no-op if it is not armed).
+ *
+ * @param   heap        Pointer to timer heap
+ * @param   entry       Pointer to timer entry
+*/
+void timer_cancel(timer_heap_t *heap, timer_entry_t *entry);
+
+/**
+ * Check whether a timer entry is armed.
+ *
+ * @param   entry       Pointer to timer entry
+ *
+ * @return  1 iff armed, 0 otherwise
+*/
+int timer_armed(timer_entry_t *entry);
+
+/**
+ * Get the armed timer entry with the earliest deadline.
+ *
+ * @param   heap        Pointer to timer heap
+ *
+ * @return  Pointer to timer entry (NULL if none)
+*/
+timer_entry_t* timer_first(timer_heap_t *heap);
+
+/**
+ * Remove and return the earliest timer entry if it has expired.
+ *
+ * @param   heap        Pointer to timer heap
+ * @param   now         Current time in milliseconds
+ *
+ * @return  Pointer to the expired timer entry, now disarmed (NULL if none is due)
+*/
+timer_entry_t* timer_pop_expired(timer_heap_t *heap, long now);
+
+#endif /* TIMER_H */